@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdlib.h>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <math.h>
+
+#include "player.hpp"
+
+// Render time of every visualizer at a given frame size: the generic build
+// against whatever specialize() picks for that size, and for the point
+// visualizers the float implementation they replaced.  All draw the same
+// synthetic stereo signal, one player frame's worth of samples at a time.
+
+// The point visualizers as they were before plot<>: span/di/i_cent worked out
+// per column and a float divide per sample.  Kept only as a reference.
+void benchmark_float_trace(struct vis_data * v, uint32_t background, uint32_t left, uint32_t right){
+    int16_t * song = v->song;
+    size_t samples = v->samples;
+    uint32_t * vis_array = v->vis_array;
+    int w = v->w;
+    int h = v->h;
+    int stride = v->stride;
+
+    fill_rows(vis_array,w,h,stride,background);
+
+    for (int i=0;i<w;i++){
+        int sample_idx = (size_t)(i*((float)samples/(float)w));
+        sample_idx = ((sample_idx%2 == 0) ? sample_idx : sample_idx - 1);
+
+        float span = 140000;
+        float di  = span/h;
+        float i_cent = (h-1.0f)/2.0f;
+
+        int vertical_idx = song[sample_idx]/di+i_cent;
+        vis_array[i + vertical_idx*stride] = left;
+        vertical_idx = song[sample_idx+1]/di + i_cent;
+        vis_array[i + vertical_idx*stride] = right;
+    }
+}
+
+void benchmark_float_xy(struct vis_data * v, uint32_t background, uint32_t color){
+    int16_t * song = v->song;
+    size_t samples = v->samples;
+    uint32_t * vis_array = v->vis_array;
+    int w = v->w;
+    int h = v->h;
+    int stride = v->stride;
+
+    fill_rows(vis_array,w,h,stride,background);
+
+    for (int i=0;i<samples;i+=2){
+        float span = 110000;
+        float di  = span/std::min(w,h);
+        float i_cent = (h-1.0f)/2.0f;
+        float x_cent = (w-1.0f)/2.0f;
+
+        int x = song[i]/di + x_cent;
+        int y = song[i+1]/di + i_cent;
+        vis_array[x + y*stride] = color;
+    }
+}
+
+struct benchmark_reference{
+    callback vis;
+    callback reference;
+};
+
+const benchmark_reference benchmark_references[] = {
+    {simple,       [](struct vis_data * v){benchmark_float_trace(v,0x00000000,0xFFFF0000,0xFF0000FF);}},
+    {simple_bw,    [](struct vis_data * v){benchmark_float_trace(v,0xFFFFFFFF,0xFF000000,0xFF000000);}},
+    {hacker,       [](struct vis_data * v){benchmark_float_trace(v,0xFF000000,0xFF00FF00,0xFF00FF00);}},
+    {oscilloscope, [](struct vis_data * v){benchmark_float_xy(v,0xFF000000,0xFF00FF00);}}
+};
+
+double benchmark_ms_per_frame(callback vis, struct vis_data &v, int frames){
+    vis(&v);  // Warm up caches (and any statics)
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int f=0;f<frames;f++){
+        v.indexed = false;
+        vis(&v);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double,std::milli>(end - start).count()/frames;
+}
+
+int benchmark_visualizers(int w, int h, int frames){
+
+    // Same samples per frame as playback at 44.1 kHz and 24 fps
+    size_t samples = 44100/24;
+    std::vector<int16_t> song(2*samples);
+    for (size_t i=0;i<samples;i++){
+        song[2*i]   = 20000*sin(2*M_PI*220.0*i/44100.0);
+        song[2*i+1] = 20000*sin(2*M_PI*330.0*i/44100.0 + 0.5);
+    }
+    std::vector<uint32_t> vis_array((size_t)w*h,0);
+    std::vector<uint8_t> index_array((size_t)w*h,0);
+
+    worker_pool pool;  // Same setup as playback
+    float peaks[2] = {0.0f,0.0f};
+    struct vis_data v;
+    v.song        = &song[0];
+    v.samples     = samples;
+    v.vis_array   = &vis_array[0];
+    v.w           = w;
+    v.h           = h;
+    v.stride      = w;
+    v.pool        = &pool;
+    v.peaks       = peaks;
+    v.index_array = &index_array[0];
+    v.indexed     = false;
+
+    std::cout << "Visualizer render times at " << w << "x" << h << ", " << frames << " frames" << std::endl;
+    for (size_t i=0;i<available_visualizations.size();i++){
+        callback generic = available_visualizations[i];
+        callback fixed   = specialize(generic,w,h);
+
+        double generic_ms = benchmark_ms_per_frame(generic,v,frames);
+        std::cout << "  [" << i << "] generic " << generic_ms << " ms";
+        for (const benchmark_reference & ref : benchmark_references){
+            if (ref.vis == generic){
+                double float_ms = benchmark_ms_per_frame(ref.reference,v,frames);
+                std::cout << ", float reference " << float_ms << " ms (" << float_ms/generic_ms << "x)";
+            }
+        }
+        if (fixed != generic){
+            double fixed_ms = benchmark_ms_per_frame(fixed,v,frames);
+            std::cout << ", specialized " << fixed_ms << " ms (" << generic_ms/fixed_ms << "x)";
+        }
+        std::cout << std::endl;
+    }
+
+    // The connected, faded trace against the plain dot plot of the same
+    // points, both as used in playback
+    double dots_ms  = benchmark_ms_per_frame(specialize(oscilloscope,w,h),v,frames);
+    double trace_ms = benchmark_ms_per_frame(oscilloscope_fancy,v,frames);
+    std::cout << "oscilloscope_fancy " << trace_ms << " ms vs oscilloscope " << dots_ms
+              << " ms (" << trace_ms/dots_ms << "x)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdlib.h>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <math.h>
+
+#include "visualizers.h"
+#include "palette.h"
+#include "worker_pool.hpp"
+
+// Several visualizers at once, tiled into sub-rectangles of one framebuffer.
+// Each one gets a vis_data whose vis_array points at its viewport's top left
+// corner with the full framebuffer width as stride.  Viewports render in
+// parallel and the composite is uploaded once per frame.  palette_offset
+// rotates the palettes of indexed viewports on top of their own offset.
+
+struct viewport{
+    callback render_frame;
+    int x;
+    int y;
+    int w;
+    int h;
+    std::vector<uint8_t> index_array;  // Indexed visualizers draw here first
+    float peaks[2] = {0.0f,0.0f};      // Per-view visualizer state (vis_data::peaks)
+
+    // Frame time since the last report
+    double total_ms = 0.0;
+    int frames = 0;
+};
+
+class compositor{
+public:
+
+    void set_layout(const std::vector<callback> &vis, int w, int h);
+    void render(int16_t * song, size_t samples, uint32_t * vis_array, worker_pool * pool, uint8_t palette_offset = 0);
+    void report();
+
+    bool empty(){return viewports.empty();};
+
+private:
+
+    std::vector<viewport> viewports;
+    int width = 0;
+    int height = 0;
+    bool needs_clear = true;
+};
+
+void compositor::set_layout(const std::vector<callback> &vis, int w, int h){
+    width  = w;
+    height = h;
+    viewports.clear();
+    if (vis.empty())
+        return;
+
+    // As square a grid as possible; leftover pixels on the right and bottom
+    // edges stay black
+    int cols = (int)ceil(sqrt((double)vis.size()));
+    int rows = (vis.size() + cols - 1)/cols;
+    int tile_w = w/cols;
+    int tile_h = h/rows;
+
+    viewports.resize(vis.size());
+    for (size_t i=0;i<vis.size();i++){
+        viewport & vp = viewports[i];
+        vp.render_frame = vis[i];
+        vp.x = (i % cols)*tile_w;
+        vp.y = (i / cols)*tile_h;
+        vp.w = tile_w;
+        vp.h = tile_h;
+        vp.index_array.assign(tile_w*tile_h,0);
+    }
+    needs_clear = true;
+}
+
+void compositor::render(int16_t * song, size_t samples, uint32_t * vis_array, worker_pool * pool, uint8_t palette_offset){
+
+    if (needs_clear){
+        for (size_t i=0;i<(size_t)width*height;i++)
+            vis_array[i] = 0xFF000000;
+        needs_clear = false;
+    }
+
+    // Viewports only ever write inside their own rectangle, and the audio
+    // window is shared read-only
+    pool->parallel_for(viewports.size(),[&](size_t i){
+        viewport & vp = viewports[i];
+        auto start = std::chrono::high_resolution_clock::now();
+
+        struct vis_data v;
+        v.song        = song;
+        v.samples     = samples;
+        v.vis_array   = vis_array + vp.y*width + vp.x;
+        v.w           = vp.w;
+        v.h           = vp.h;
+        v.stride      = width;
+        v.pool        = pool;  // Nested parallel_for is fine: callers work their own indices
+        v.peaks       = vp.peaks;
+        v.index_array = &vp.index_array[0];
+        v.indexed     = false;
+        vp.render_frame(&v);
+
+        if (v.indexed)
+            palette_expand_rows(v.index_array,vp.w,vp.h,v.palette,v.palette_offset + palette_offset,v.vis_array,width);
+
+        auto end = std::chrono::high_resolution_clock::now();
+        vp.total_ms += std::chrono::duration<double,std::milli>(end - start).count();
+        vp.frames++;
+    });
+}
+
+void compositor::report(){
+    std::cout << "Viewport frame times:";
+    for (size_t i=0;i<viewports.size();i++){
+        viewport & vp = viewports[i];
+        std::cout << " [" << i << "] " << (vp.frames ? vp.total_ms/vp.frames : 0.0) << " ms";
+        vp.total_ms = 0.0;
+        vp.frames = 0;
+    }
+    std::cout << std::endl;
+}
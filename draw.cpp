@@ -0,0 +1,236 @@
+#include "draw.h"
+#include <math.h>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static inline void blend_add(uint32_t * px, uint32_t color, uint32_t cov){
+    // cov is 0..256.  Scale R/B and G in two lanes, then saturate each
+    // channel separately.
+    uint32_t rb = (((color & 0x00FF00FF)*cov) >> 8) & 0x00FF00FF;
+    uint32_t g  = (((color & 0x0000FF00)*cov) >> 8) & 0x0000FF00;
+    uint32_t p  = *px;
+
+    uint32_t r_out = std::min((p & 0x00FF0000) + (rb & 0x00FF0000),(uint32_t)0x00FF0000);
+    uint32_t g_out = std::min((p & 0x0000FF00) + g,(uint32_t)0x0000FF00);
+    uint32_t b_out = std::min((p & 0x000000FF) + (rb & 0x000000FF),(uint32_t)0x000000FF);
+    *px = 0xFF000000 | r_out | g_out | b_out;
+}
+
+static inline void plot(uint32_t * buf, int w, int h, int stride, int x, int y, uint32_t color, uint32_t cov){
+    // Clipping leaves the line inside the buffer, but Wu also touches the
+    // pixel below, which can be one row past the edge
+    if ((unsigned)x < (unsigned)w && (unsigned)y < (unsigned)h && cov > 0)
+        blend_add(&buf[x + y*stride],color,cov);
+}
+
+void draw_span_add(uint32_t * px, int n, uint32_t color){
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i c     = _mm_set1_epi32(color & 0x00FFFFFF);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    for (;i+4<=n;i+=4){
+        __m128i p = _mm_loadu_si128((__m128i*)(px+i));
+        _mm_storeu_si128((__m128i*)(px+i),_mm_or_si128(_mm_adds_epu8(p,c),alpha));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t c     = vreinterpretq_u8_u32(vdupq_n_u32(color & 0x00FFFFFF));
+    const uint32x4_t alpha = vdupq_n_u32(0xFF000000);
+    for (;i+4<=n;i+=4){
+        uint8x16_t p = vreinterpretq_u8_u32(vld1q_u32(px+i));
+        vst1q_u32(px+i,vorrq_u32(vreinterpretq_u32_u8(vqaddq_u8(p,c)),alpha));
+    }
+#endif
+    for (;i<n;i++)
+        blend_add(&px[i],color,256);
+}
+
+static inline void blend_add4(uint32_t * px, uint32_t color, const uint32_t cov[4]){
+    // Four neighbouring pixels with their own coverage, same result as
+    // blend_add on each
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i c   = _mm_unpacklo_epi8(_mm_set1_epi32(color & 0x00FFFFFF),zero);
+    __m128i lo  = _mm_mullo_epi16(c,_mm_set_epi16(cov[1],cov[1],cov[1],cov[1],cov[0],cov[0],cov[0],cov[0]));
+    __m128i hi  = _mm_mullo_epi16(c,_mm_set_epi16(cov[3],cov[3],cov[3],cov[3],cov[2],cov[2],cov[2],cov[2]));
+    __m128i add = _mm_packus_epi16(_mm_srli_epi16(lo,8),_mm_srli_epi16(hi,8));
+    __m128i p   = _mm_loadu_si128((__m128i*)px);
+    _mm_storeu_si128((__m128i*)px,_mm_or_si128(_mm_adds_epu8(p,add),_mm_set1_epi32(0xFF000000)));
+#elif defined(__ARM_NEON)
+    uint8x8_t c = vreinterpret_u8_u32(vdup_n_u32(color & 0x00FFFFFF));
+    uint16x8_t cw = vmovl_u8(c);
+    uint16x8_t k_lo = vcombine_u16(vdup_n_u16(cov[0]),vdup_n_u16(cov[1]));
+    uint16x8_t k_hi = vcombine_u16(vdup_n_u16(cov[2]),vdup_n_u16(cov[3]));
+    uint8x16_t add  = vcombine_u8(vshrn_n_u16(vmulq_u16(cw,k_lo),8),vshrn_n_u16(vmulq_u16(cw,k_hi),8));
+    uint8x16_t p    = vreinterpretq_u8_u32(vld1q_u32(px));
+    vst1q_u32(px,vorrq_u32(vreinterpretq_u32_u8(vqaddq_u8(p,add)),vdupq_n_u32(0xFF000000)));
+#else
+    for (int k=0;k<4;k++)
+        blend_add(&px[k],color,cov[k]);
+#endif
+}
+
+void draw_fade(uint32_t * px, int n, uint32_t mask, uint32_t keep){
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i k     = _mm_set1_epi16((short)keep);
+    const __m128i m     = _mm_set1_epi32(mask & 0x00FFFFFF);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    for (;i+4<=n;i+=4){
+        __m128i p  = _mm_and_si128(_mm_loadu_si128((__m128i*)(px+i)),m);
+        __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(p,zero),k),8);
+        __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(p,zero),k),8);
+        _mm_storeu_si128((__m128i*)(px+i),_mm_or_si128(_mm_packus_epi16(lo,hi),alpha));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x8_t k      = vdup_n_u8((uint8_t)keep);
+    const uint32x4_t m     = vdupq_n_u32(mask & 0x00FFFFFF);
+    const uint32x4_t alpha = vdupq_n_u32(0xFF000000);
+    for (;i+4<=n;i+=4){
+        uint8x16_t p = vreinterpretq_u8_u32(vandq_u32(vld1q_u32(px+i),m));
+        uint8x16_t f = vcombine_u8(vshrn_n_u16(vmull_u8(vget_low_u8(p),k),8),
+                                   vshrn_n_u16(vmull_u8(vget_high_u8(p),k),8));
+        vst1q_u32(px+i,vorrq_u32(vreinterpretq_u32_u8(f),alpha));
+    }
+#endif
+    for (;i<n;i++){
+        uint32_t p = px[i] & mask;
+        uint32_t f = 0;
+        for (int c=0;c<24;c+=8)
+            f |= ((((p >> c) & 0xFF)*keep) >> 8) << c;
+        px[i] = 0xFF000000 | f;
+    }
+}
+
+static bool clip_segment(float & x0, float & y0, float & x1, float & y1, float x_max, float y_max){
+    // Liang-Barsky against [0,x_max] x [0,y_max]
+    float t0 = 0.0f, t1 = 1.0f;
+    float dx = x1 - x0, dy = y1 - y0;
+    float p[4] = {-dx, dx, -dy, dy};
+    float q[4] = {x0, x_max - x0, y0, y_max - y0};
+
+    for (int i=0;i<4;i++){
+        if (p[i] == 0.0f){
+            if (q[i] < 0.0f)
+                return false;
+            continue;
+        }
+        float t = q[i]/p[i];
+        if (p[i] < 0.0f)
+            t0 = std::max(t0,t);
+        else
+            t1 = std::min(t1,t);
+        if (t0 > t1)
+            return false;
+    }
+
+    float ox = x0, oy = y0;
+    x0 = ox + t0*dx; y0 = oy + t0*dy;
+    x1 = ox + t1*dx; y1 = oy + t1*dy;
+    return true;
+}
+
+static void draw_segment(float x0, float y0, float x1, float y1, uint32_t * buf, int w, int h, int stride, uint32_t color){
+
+    if (!clip_segment(x0,y0,x1,y1,w-1.0f,h-1.0f))
+        return;
+
+    // Exactly horizontal runs are a straight additive fill
+    if (y0 == y1 && y0 == floorf(y0)){
+        int xa = (int)lroundf(std::min(x0,x1));
+        int xb = (int)lroundf(std::max(x0,x1));
+        draw_span_add(&buf[xa + (int)y0*stride],xb - xa + 1,color);
+        return;
+    }
+
+    bool steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+    if (steep){
+        std::swap(x0,y0);
+        std::swap(x1,y1);
+    }
+    if (x0 > x1){
+        std::swap(x0,x1);
+        std::swap(y0,y1);
+    }
+
+    float dx = x1 - x0;
+    float dy = y1 - y0;
+    float gradient = (dx == 0.0f) ? 1.0f : dy/dx;
+
+    // Endpoints get partial coverage along the major axis
+    int xs = (int)lroundf(x0);
+    int xe = (int)lroundf(x1);
+    float ys = y0 + gradient*(xs - x0);
+    float ye = y1 + gradient*(xe - x1);
+    float gap_s = 1.0f - (x0 + 0.5f - floorf(x0 + 0.5f));
+    float gap_e = x1 + 0.5f - floorf(x1 + 0.5f);
+
+    for (int e=0;e<2;e++){
+        int x    = e ? xe : xs;
+        float y  = e ? ye : ys;
+        float gp = e ? gap_e : gap_s;
+        int yi   = (int)floorf(y);
+        float f  = y - yi;
+        uint32_t c0 = (uint32_t)((1.0f - f)*gp*256.0f);
+        uint32_t c1 = (uint32_t)(f*gp*256.0f);
+        if (steep){
+            plot(buf,w,h,stride,yi,x,color,c0);
+            plot(buf,w,h,stride,yi+1,x,color,c1);
+        }
+        else{
+            plot(buf,w,h,stride,x,yi,color,c0);
+            plot(buf,w,h,stride,x,yi+1,color,c1);
+        }
+    }
+
+    // Interior in 16.16 fixed point: the top 8 fraction bits are the coverage
+    int32_t intery = (int32_t)((ys + gradient)*65536.0f);
+    int32_t step   = (int32_t)(gradient*65536.0f);
+    if (steep){
+        for (int x=xs+1;x<xe;x++){
+            int yi = intery >> 16;
+            uint32_t f = (intery >> 8) & 0xFF;
+            plot(buf,w,h,stride,yi,x,color,256 - f);
+            plot(buf,w,h,stride,yi+1,x,color,f);
+            intery += step;
+        }
+    }
+    else{
+        for (int x=xs+1;x<xe;){
+            int yi = intery >> 16;
+
+            // Shallow runs put several neighbouring pixels on the same pair
+            // of rows; blend those four at a time
+            if (x + 4 <= xe && ((intery + 3*step) >> 16) == yi &&
+                x >= 0 && x + 4 <= w && yi >= 0 && yi + 1 < h){
+                uint32_t c0[4], c1[4];
+                for (int k=0;k<4;k++){
+                    uint32_t f = ((intery + k*step) >> 8) & 0xFF;
+                    c0[k] = 256 - f;
+                    c1[k] = f;
+                }
+                blend_add4(&buf[x + yi*stride],color,c0);
+                blend_add4(&buf[x + (yi+1)*stride],color,c1);
+                x += 4;
+                intery += 4*step;
+                continue;
+            }
+
+            uint32_t f = (intery >> 8) & 0xFF;
+            plot(buf,w,h,stride,x,yi,color,256 - f);
+            plot(buf,w,h,stride,x,yi+1,color,f);
+            x++;
+            intery += step;
+        }
+    }
+}
+
+void draw_polyline(const point * pts, size_t n, uint32_t * buf, int w, int h, int stride, uint32_t color){
+    for (size_t i=1;i<n;i++)
+        draw_segment(pts[i-1].x,pts[i-1].y,pts[i].x,pts[i].y,buf,w,h,stride,color);
+}
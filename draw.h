@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Batched line drawing into ARGB framebuffers.  Everything is clipped to the
+// w x h buffer (rows are `stride` pixels apart) and blended additively with
+// per-channel saturation, so overlapping traces brighten instead of
+// overwriting each other.
+
+struct point{
+    float x;
+    float y;
+};
+
+// Connected polyline through n points (n-1 segments), Xiaolin Wu
+// anti-aliasing, all octants.
+void draw_polyline(const point * pts, size_t n, uint32_t * buf, int w, int h, int stride, uint32_t color);
+
+// Full-coverage additive fill of n consecutive pixels.
+void draw_span_add(uint32_t * px, int n, uint32_t color);
+
+// Trail decay: keeps only the channels in mask, each scaled by keep/256
+// (keep < 256), and sets alpha.
+void draw_fade(uint32_t * px, int n, uint32_t mask, uint32_t keep);
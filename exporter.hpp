@@ -0,0 +1,351 @@
+#pragma once
+
+#include <stdlib.h>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <SDL2/SDL.h>
+
+extern "C"{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include "player.hpp"
+#include "worker_pool.hpp"
+#include "sample_format.h"
+
+// Headless render-to-video.  Visualizer frames are computed straight from the
+// decoded track at a fixed frame rate (no audio device, no window) at the
+// output size, converted with swscale and muxed together with the audio by libavformat.
+
+struct export_settings{
+    std::string track;
+    std::string output;
+    int vis_idx    = 4;     // oscilloscope; frames of stateless visualizers render in parallel
+    int fps        = 24;
+    int out_width  = 1280;  // Visualizers draw at the output size
+    int out_height = 720;
+};
+
+void export_log_error(const std::string &msg, int err){
+    char buf[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_strerror(err,buf,sizeof(buf));
+    std::cout << msg << " error: " << buf << std::endl;
+}
+
+bool export_is_stateless(callback cb){
+    // These read back last frame's pixels or keep running maxima, so frame k
+    // depends on frame k-1 and has to be rendered in order
+    return !(cb == oscilloscope_fancy || cb == experimental);
+}
+
+int export_write_packets(AVFormatContext * oc, AVCodecContext * enc, AVStream * st, AVFrame * frame){
+    int ret = avcodec_send_frame(enc,frame);
+    if (ret < 0){
+        export_log_error("avcodec_send_frame",ret);
+        return ret;
+    }
+
+    AVPacket * pkt = av_packet_alloc();
+    while (true){
+        ret = avcodec_receive_packet(enc,pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+            ret = 0;
+            break;
+        }
+        if (ret < 0){
+            export_log_error("avcodec_receive_packet",ret);
+            break;
+        }
+        av_packet_rescale_ts(pkt,enc->time_base,st->time_base);
+        pkt->stream_index = st->index;
+        ret = av_interleaved_write_frame(oc,pkt);
+        if (ret < 0){
+            export_log_error("av_interleaved_write_frame",ret);
+            break;
+        }
+    }
+    av_packet_free(&pkt);
+    return ret;
+}
+
+void export_fill_audio(AVFrame * frame, const int16_t * song, size_t start, size_t n, size_t total_frames){
+    // Interleaved S16 stereo into whatever the encoder asked for.  Past the end
+    // of the track is silence.
+    for (size_t i=0;i<(size_t)frame->nb_samples;i++){
+        int16_t l = 0, r = 0;
+        if (i < n && start + i < total_frames){
+            l = song[2*(start+i)];
+            r = song[2*(start+i)+1];
+        }
+        switch (frame->format){
+        case AV_SAMPLE_FMT_S16:
+            ((int16_t*)frame->data[0])[2*i]   = l;
+            ((int16_t*)frame->data[0])[2*i+1] = r;
+            break;
+        case AV_SAMPLE_FMT_S16P:
+            ((int16_t*)frame->data[0])[i] = l;
+            ((int16_t*)frame->data[1])[i] = r;
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            ((float*)frame->data[0])[2*i]   = l/32768.0f;
+            ((float*)frame->data[0])[2*i+1] = r/32768.0f;
+            break;
+        case AV_SAMPLE_FMT_FLTP:
+            ((float*)frame->data[0])[i] = l/32768.0f;
+            ((float*)frame->data[1])[i] = r/32768.0f;
+            break;
+        }
+    }
+}
+
+bool export_supported_sample_fmt(AVSampleFormat fmt){
+    return fmt == AV_SAMPLE_FMT_S16 || fmt == AV_SAMPLE_FMT_S16P ||
+           fmt == AV_SAMPLE_FMT_FLT || fmt == AV_SAMPLE_FMT_FLTP;
+}
+
+int export_video(const export_settings &s){
+
+    if (s.vis_idx < 0 || s.vis_idx >= (int)available_visualizations.size()){
+        std::cout << "Visualizer index out of range (0-" << available_visualizations.size()-1 << ")" << std::endl;
+        return 1;
+    }
+    callback render_frame = specialize(available_visualizations[s.vis_idx],s.out_width,s.out_height);
+
+    // Load the track with the same loader as playback
+    SDL_AudioSpec wav;
+    uint8_t * wav_data;
+    uint32_t wav_bytes;
+    if (SDL_LoadWAV(s.track.c_str(),&wav,&wav_data,&wav_bytes) == NULL){
+        imshow_log_error(std::cout,"SDL_LoadWAV");
+        return 1;
+    }
+
+    // Same canonical layout as playback (interleaved stereo S16)
+    int16_t * song;
+    size_t total_frames = convert_to_canonical(wav_data,wav_bytes,wav.format,wav.channels,&song);
+    SDL_FreeWAV(wav_data);
+    if (total_frames == 0){
+        std::cout << "Unsupported sample format" << std::endl;
+        return 1;
+    }
+    size_t sampling_rate     = wav.freq;
+    size_t samples_per_frame = sampling_rate/s.fps;
+    size_t n_video_frames    = (total_frames*s.fps + sampling_rate - 1)/sampling_rate;
+
+    // Output container and streams
+    AVFormatContext * oc = NULL;
+    int ret = avformat_alloc_output_context2(&oc,NULL,NULL,s.output.c_str());
+    if (ret < 0){
+        export_log_error("avformat_alloc_output_context2",ret);
+        SDL_free(song);
+        return 1;
+    }
+
+    AVCodec * vcodec = (AVCodec*)avcodec_find_encoder(oc->oformat->video_codec);
+    AVCodec * acodec = (AVCodec*)avcodec_find_encoder(oc->oformat->audio_codec);
+    if (vcodec == NULL || acodec == NULL){
+        std::cout << "No encoder for output format " << oc->oformat->name << std::endl;
+        avformat_free_context(oc);
+        SDL_free(song);
+        return 1;
+    }
+
+    AVStream * vst = avformat_new_stream(oc,NULL);
+    AVCodecContext * venc = avcodec_alloc_context3(vcodec);
+    venc->width        = s.out_width;
+    venc->height       = s.out_height;
+    venc->time_base    = av_make_q(1,s.fps);
+    venc->framerate    = av_make_q(s.fps,1);
+    venc->gop_size     = 12;
+    venc->pix_fmt      = vcodec->pix_fmts ? vcodec->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+    venc->bit_rate     = 8000000;
+    venc->thread_count = 0;
+    vst->time_base     = venc->time_base;
+
+    AVStream * ast = avformat_new_stream(oc,NULL);
+    AVCodecContext * aenc = avcodec_alloc_context3(acodec);
+    aenc->sample_fmt     = AV_SAMPLE_FMT_FLTP;
+    if (acodec->sample_fmts){
+        aenc->sample_fmt = acodec->sample_fmts[0];
+        for (int i=0;acodec->sample_fmts[i] != AV_SAMPLE_FMT_NONE;i++){
+            if (export_supported_sample_fmt(acodec->sample_fmts[i])){
+                aenc->sample_fmt = acodec->sample_fmts[i];
+                break;
+            }
+        }
+    }
+    aenc->sample_rate    = sampling_rate;
+    av_channel_layout_default(&aenc->ch_layout,2);
+    aenc->bit_rate       = 192000;
+    aenc->time_base      = av_make_q(1,(int)sampling_rate);
+    ast->time_base       = aenc->time_base;
+
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER){
+        venc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        aenc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    bool ok = export_supported_sample_fmt(aenc->sample_fmt);
+    if (!ok)
+        std::cout << "Unsupported audio sample format for " << acodec->name << std::endl;
+    if (ok && (ret = avcodec_open2(venc,vcodec,NULL)) < 0){
+        export_log_error("avcodec_open2 (video)",ret);
+        ok = false;
+    }
+    if (ok && (ret = avcodec_open2(aenc,acodec,NULL)) < 0){
+        export_log_error("avcodec_open2 (audio)",ret);
+        ok = false;
+    }
+    if (ok){
+        avcodec_parameters_from_context(vst->codecpar,venc);
+        avcodec_parameters_from_context(ast->codecpar,aenc);
+    }
+    if (ok && !(oc->oformat->flags & AVFMT_NOFILE) && (ret = avio_open(&oc->pb,s.output.c_str(),AVIO_FLAG_WRITE)) < 0){
+        export_log_error("avio_open",ret);
+        ok = false;
+    }
+    if (ok && (ret = avformat_write_header(oc,NULL)) < 0){
+        export_log_error("avformat_write_header",ret);
+        ok = false;
+    }
+
+    // Frames in a batch are rendered and converted in parallel, then handed
+    // to the encoder in order.  Stateful visualizers get a batch of one, and
+    // big frames smaller batches (about 64M pixels in flight at most).
+    worker_pool pool;
+    size_t frame_px = (size_t)s.out_width*s.out_height;
+    size_t batch = export_is_stateless(render_frame) ? 2*pool.size() : 1;
+    batch = std::max((size_t)1,std::min(batch,((size_t)64 << 20)/frame_px));
+
+    std::vector<uint32_t*> vis_arrays(batch);
+    std::vector<uint8_t*> index_arrays(batch);
+    std::vector<int16_t*> frame_buffers(batch);
+    std::vector<SwsContext*> scalers(batch);
+    std::vector<AVFrame*> vframes(batch);
+    for (size_t i=0;i<batch;i++){
+        vis_arrays[i]    = new uint32_t[frame_px];
+        memset(vis_arrays[i],0,frame_px*sizeof(uint32_t));
+        index_arrays[i]  = new uint8_t[frame_px];
+        frame_buffers[i] = new int16_t[2*samples_per_frame];
+        scalers[i]       = sws_getContext(s.out_width,s.out_height,AV_PIX_FMT_RGB32,
+                                          s.out_width,s.out_height,venc->pix_fmt,
+                                          SWS_BICUBIC,NULL,NULL,NULL);
+        vframes[i]         = av_frame_alloc();
+        vframes[i]->format = venc->pix_fmt;
+        vframes[i]->width  = s.out_width;
+        vframes[i]->height = s.out_height;
+        av_frame_get_buffer(vframes[i],0);
+    }
+
+    int audio_frame_size = aenc->frame_size;
+    if (audio_frame_size == 0 || (acodec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+        audio_frame_size = 1024;
+    AVFrame * aframe = av_frame_alloc();
+    aframe->format         = aenc->sample_fmt;
+    av_channel_layout_copy(&aframe->ch_layout,&aenc->ch_layout);
+    aframe->sample_rate    = aenc->sample_rate;
+    aframe->nb_samples     = audio_frame_size;
+    av_frame_get_buffer(aframe,0);
+    size_t audio_pos = 0;
+
+    // Stateful visualizers run with a batch of one, so one set is enough
+    float peaks[2] = {0.0f,0.0f};
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (size_t base=0;ok && base<n_video_frames;base+=batch){
+        size_t n = std::min(batch,n_video_frames - base);
+
+        // The encoder may still hold references to last batch's frames
+        for (size_t i=0;i<n;i++)
+            av_frame_make_writable(vframes[i]);
+
+        pool.parallel_for(n,[&](size_t i){
+            size_t k = base + i;
+            size_t first = k*sampling_rate/s.fps;
+
+            // Same window the live visualizer sees: samples_per_frame stereo
+            // samples starting at the current play position, zero padded
+            for (size_t j=0;j<samples_per_frame;j++){
+                bool in_range = first + j < total_frames;
+                frame_buffers[i][2*j]   = in_range ? song[2*(first+j)]   : 0;
+                frame_buffers[i][2*j+1] = in_range ? song[2*(first+j)+1] : 0;
+            }
+
+            struct vis_data v;
+            v.w         = s.out_width;
+            v.h         = s.out_height;
+            v.stride    = s.out_width;
+            v.pool      = NULL;  // Frames already run in parallel
+            v.peaks     = peaks;
+            v.song      = frame_buffers[i];
+            v.samples   = samples_per_frame;
+            v.vis_array = vis_arrays[i];
+            v.index_array = index_arrays[i];
+            v.indexed   = false;
+            render_frame(&v);
+            if (v.indexed)
+                palette_expand(v.index_array,frame_px,v.palette,v.palette_offset,vis_arrays[i]);
+
+            // Same size in and out; swscale only converts to the encoder's format
+            const uint8_t * src[1] = {(uint8_t*)vis_arrays[i]};
+            int src_stride[1]      = {4*s.out_width};
+            sws_scale(scalers[i],src,src_stride,0,s.out_height,vframes[i]->data,vframes[i]->linesize);
+            vframes[i]->pts = k;
+        });
+
+        for (size_t i=0;ok && i<n;i++){
+            if (export_write_packets(oc,venc,vst,vframes[i]) < 0)
+                ok = false;
+
+            // Keep the audio stream caught up to the end of this video frame
+            size_t audio_target = std::min((base+i+1)*sampling_rate/s.fps,total_frames);
+            while (ok && audio_pos < audio_target){
+                av_frame_make_writable(aframe);
+                export_fill_audio(aframe,song,audio_pos,audio_frame_size,total_frames);
+                aframe->pts = audio_pos;
+                if (export_write_packets(oc,aenc,ast,aframe) < 0)
+                    ok = false;
+                audio_pos += audio_frame_size;
+            }
+        }
+
+        if (base % (50*batch) == 0)
+            std::cout << "Exported " << base + n << "/" << n_video_frames << " frames" << std::endl;
+    }
+
+    if (ok){
+        // Flush
+        export_write_packets(oc,venc,vst,NULL);
+        export_write_packets(oc,aenc,ast,NULL);
+        av_write_trailer(oc);
+
+        auto end = std::chrono::high_resolution_clock::now();
+        float elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count()/1000.0f;
+        float duration = (float)total_frames/(float)sampling_rate;
+        std::cout << "Wrote " << s.output << ": " << duration << " s of audio in " << elapsed
+                  << " s (" << duration/std::max(elapsed,0.001f) << "x real time)" << std::endl;
+    }
+
+    for (size_t i=0;i<batch;i++){
+        delete[] vis_arrays[i];
+        delete[] index_arrays[i];
+        delete[] frame_buffers[i];
+        sws_freeContext(scalers[i]);
+        av_frame_free(&vframes[i]);
+    }
+    av_frame_free(&aframe);
+    avcodec_free_context(&venc);
+    avcodec_free_context(&aenc);
+    if (oc->pb && !(oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&oc->pb);
+    avformat_free_context(oc);
+    SDL_free(song);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <stdlib.h>
+#include <cstdio>
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_audio.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Audio the player doesn't decode itself (line in, another process piping
+// raw PCM).  Sources push interleaved stereo S16 into a lock-free ring; the
+// visualizer just grabs the newest window every frame, so latency is one
+// capture/read block plus one video frame.
+
+class sample_ring{
+public:
+
+    sample_ring(size_t min_frames);
+
+    // Single producer
+    void write(const int16_t * src, size_t frames);
+
+    // Copies the newest `frames` frames.  Zero filled if fewer have been
+    // written so far.  A writer lapping the reader mid-copy can only tear a
+    // visualizer frame, never corrupt anything.
+    void read_latest(int16_t * dst, size_t frames);
+
+private:
+
+    std::vector<int16_t> buf;
+    size_t mask;
+    std::atomic<uint64_t> write_pos{0};  // In frames, never wraps
+};
+
+sample_ring::sample_ring(size_t min_frames){
+    size_t n = 1;
+    while (n < min_frames)
+        n <<= 1;
+    buf.assign(2*n,0);
+    mask = n - 1;
+}
+
+void sample_ring::write(const int16_t * src, size_t frames){
+    uint64_t wp = write_pos.load(std::memory_order_relaxed);
+    for (size_t i=0;i<frames;i++){
+        size_t idx = (wp + i) & mask;
+        buf[2*idx]   = src[2*i];
+        buf[2*idx+1] = src[2*i+1];
+    }
+    write_pos.store(wp + frames,std::memory_order_release);
+}
+
+void sample_ring::read_latest(int16_t * dst, size_t frames){
+    uint64_t wp = write_pos.load(std::memory_order_acquire);
+    frames = std::min(frames,mask + 1);
+
+    size_t missing = (wp < frames) ? frames - wp : 0;
+    memset(dst,0,2*missing*sizeof(int16_t));
+
+    for (size_t i=missing;i<frames;i++){
+        size_t idx = (wp - frames + i) & mask;
+        dst[2*i]   = buf[2*idx];
+        dst[2*i+1] = buf[2*idx+1];
+    }
+}
+
+class input_source{
+public:
+
+    input_source(int rate) : sampling_rate(rate), ring(rate) {};  // One second of history
+    virtual ~input_source(){};
+
+    virtual bool start() = 0;
+    virtual void stop() = 0;
+
+    int get_sampling_rate(){return sampling_rate;};
+    sample_ring * get_ring(){return &ring;};
+    bool has_ended(){return ended;};  // Nothing more will be written to the ring
+
+protected:
+
+    int sampling_rate;
+    sample_ring ring;
+    std::atomic<bool> ended{false};
+};
+
+// SDL capture device (iscapture=1).  SDL converts to S16 stereo for us.
+class capture_source : public input_source{
+public:
+
+    capture_source(const char * device_name, int rate, int buffer_size)
+        : input_source(rate), name(device_name ? device_name : ""), samples(buffer_size) {};
+    ~capture_source(){stop();};
+
+    bool start();
+    void stop();
+
+private:
+
+    static void capture_callback(void * udata, uint8_t * stream, int len){
+        capture_source * c = (capture_source *)udata;
+        c->ring.write((int16_t *)stream,len/(2*sizeof(int16_t)));
+    }
+
+    std::string name;
+    int samples;
+    SDL_AudioDeviceID dev = 0;
+};
+
+bool capture_source::start(){
+    SDL_AudioSpec want,have;
+    SDL_zero(want);
+    want.freq     = sampling_rate;
+    want.format   = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples  = samples;
+    want.callback = capture_callback;
+    want.userdata = this;
+
+    dev = SDL_OpenAudioDevice(name.empty() ? NULL : name.c_str(), 1, &want, &have, 0);
+    if (dev == 0){
+        SDL_Log("Failed to open capture device: %s", SDL_GetError());
+        return false;
+    }
+    SDL_PauseAudioDevice(dev,0);
+    return true;
+}
+
+void capture_source::stop(){
+    if (dev > 0)
+        SDL_CloseAudioDevice(dev);
+    dev = 0;
+}
+
+// Raw interleaved S16LE stereo from stdin or a named pipe, e.g.
+//   ffmpeg -i song.flac -f s16le -ac 2 -ar 44100 - | audio_vis --stdin
+class pipe_source : public input_source{
+public:
+
+    pipe_source(const char * fifo_path, int rate)
+        : input_source(rate), path(fifo_path ? fifo_path : "") {};
+    ~pipe_source(){stop();};
+
+    bool start();
+    void stop();
+
+private:
+
+    void reader_loop();
+
+    std::string path;  // Empty means stdin
+    std::thread reader;
+    std::atomic<bool> stopping{false};
+};
+
+bool pipe_source::start(){
+    stopping = false;
+    ended = false;
+    reader = std::thread(&pipe_source::reader_loop,this);
+    return true;
+}
+
+void pipe_source::stop(){
+    stopping = true;
+    if (reader.joinable())
+        reader.join();  // The reader never blocks for longer than one poll
+}
+
+void pipe_source::reader_loop(){
+
+    // A blocking open() on a FIFO waits for the writer and can't be
+    // interrupted, so open non-blocking and wait for the writer in poll()
+    int fd = 0;
+    if (!path.empty()){
+        fd = open(path.c_str(),O_RDONLY | O_NONBLOCK);
+        if (fd < 0){
+            std::cout << "Couldn't open " << path << ": " << strerror(errno) << std::endl;
+            ended = true;
+            return;
+        }
+    }
+    bool connected = path.empty();  // Only a FIFO can be opened before its writer
+
+    // Small reads keep latency down; odd byte counts carry over to the next read
+    const size_t frames_per_read = 256;
+    uint8_t buf[frames_per_read*4];
+    size_t have = 0;
+
+    while (!stopping){
+        struct pollfd pfd;
+        pfd.fd     = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd,1,100) <= 0)
+            continue;
+
+        ssize_t n = read(fd,buf + have,sizeof(buf) - have);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (n == 0 && !connected){
+            // No writer yet: poll() reports hangup rather than blocking
+            usleep(100000);
+            continue;
+        }
+        if (n <= 0){
+            std::cout << "Input stream ended" << std::endl;
+            ended = true;
+            break;
+        }
+        connected = true;
+        have += n;
+
+        size_t frames = have/4;
+        ring.write((int16_t *)buf,frames);
+        memmove(buf,buf + frames*4,have - frames*4);
+        have -= frames*4;
+    }
+
+    if (fd != 0)
+        close(fd);
+}
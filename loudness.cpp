@@ -0,0 +1,192 @@
+#include "loudness.h"
+#include "polyphase.h"
+#include <math.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+struct biquad{
+    double b0, b1, b2, a1, a2;
+};
+
+static void k_weighting(int fs, biquad &shelf, biquad &highpass){
+    // BS.1770 pre-filter and RLB high pass, re-derived for any sampling rate
+    // (the spec only tabulates 48 kHz)
+    double f0 = 1681.974450955533;
+    double G  = 3.999843853973347;
+    double Q  = 0.7071752369554196;
+    double K  = tan(M_PI*f0/fs);
+    double Vh = pow(10.0,G/20.0);
+    double Vb = pow(Vh,0.4996667741545416);
+    double a0 = 1.0 + K/Q + K*K;
+    shelf.b0 = (Vh + Vb*K/Q + K*K)/a0;
+    shelf.b1 = 2.0*(K*K - Vh)/a0;
+    shelf.b2 = (Vh - Vb*K/Q + K*K)/a0;
+    shelf.a1 = 2.0*(K*K - 1.0)/a0;
+    shelf.a2 = (1.0 - K/Q + K*K)/a0;
+
+    f0 = 38.13547087602444;
+    Q  = 0.5003270373238773;
+    K  = tan(M_PI*f0/fs);
+    a0 = 1.0 + K/Q + K*K;
+    highpass.b0 = 1.0;
+    highpass.b1 = -2.0;
+    highpass.b2 = 1.0;
+    highpass.a1 = 2.0*(K*K - 1.0)/a0;
+    highpass.a2 = (1.0 - K/Q + K*K)/a0;
+}
+
+loudness_result analyze_loudness(const int16_t * stereo, size_t frames, int sampling_rate){
+
+    biquad shelf, highpass;
+    k_weighting(sampling_rate,shelf,highpass);
+
+    // Mean square of the K-weighted signal (both channels summed, weight 1)
+    // per 100 ms step; 400 ms gating blocks are four consecutive steps
+    size_t step = sampling_rate/10;
+    std::vector<double> step_power;
+    step_power.reserve(frames/step + 1);
+
+    double s1[2][2] = {{0,0},{0,0}};  // Shelf state per channel
+    double s2[2][2] = {{0,0},{0,0}};  // High pass state per channel
+    double acc = 0.0;
+    size_t in_step = 0;
+    for (size_t i=0;i<frames;i++){
+        for (int c=0;c<2;c++){
+            double x = stereo[2*i+c]/32768.0;
+
+            // Transposed direct form II
+            double y = shelf.b0*x + s1[c][0];
+            s1[c][0] = shelf.b1*x - shelf.a1*y + s1[c][1];
+            s1[c][1] = shelf.b2*x - shelf.a2*y;
+
+            double z = highpass.b0*y + s2[c][0];
+            s2[c][0] = highpass.b1*y - highpass.a1*z + s2[c][1];
+            s2[c][1] = highpass.b2*y - highpass.a2*z;
+
+            acc += z*z;
+        }
+        if (++in_step == step){
+            step_power.push_back(acc/step);
+            acc = 0.0;
+            in_step = 0;
+        }
+    }
+
+    std::vector<double> blocks;
+    for (size_t i=3;i<step_power.size();i++)
+        blocks.push_back((step_power[i-3] + step_power[i-2] + step_power[i-1] + step_power[i])/4.0);
+
+    // Absolute gate at -70 LUFS, then relative gate 10 LU below the
+    // loudness of what survived
+    double abs_gate = pow(10.0,(-70.0 + 0.691)/10.0);
+    double sum = 0.0;
+    size_t n = 0;
+    for (size_t i=0;i<blocks.size();i++){
+        if (blocks[i] > abs_gate){
+            sum += blocks[i];
+            n++;
+        }
+    }
+
+    loudness_result r;
+    r.integrated_lufs = -70.0f;
+    if (n > 0){
+        double rel_gate = sum/n*pow(10.0,-10.0/10.0);
+        double gated_sum = 0.0;
+        size_t gated_n = 0;
+        for (size_t i=0;i<blocks.size();i++){
+            if (blocks[i] > abs_gate && blocks[i] > rel_gate){
+                gated_sum += blocks[i];
+                gated_n++;
+            }
+        }
+        if (gated_n > 0)
+            r.integrated_lufs = -0.691 + 10.0*log10(gated_sum/gated_n);
+    }
+
+    // True peak: 4x oversampled, in chunks so the scratch buffer stays small
+    polyphase_interpolator interp(4,12);
+    const size_t chunk = 16384;
+    std::vector<float> up(4*chunk);
+    float peak = 0.0f;
+    for (int c=0;c<2;c++){
+        for (size_t i=0;i<frames;i+=chunk){
+            size_t end = std::min(i + chunk,frames);
+            interp.process(stereo + c,frames,2,i,end,&up[0]);
+            for (size_t j=0;j<4*(end-i);j++)
+                peak = std::max(peak,fabsf(up[j]));
+        }
+    }
+    r.true_peak_dbtp = (peak > 0.0f) ? 20.0f*log10f(peak/32768.0f) : -120.0f;
+
+    return r;
+}
+
+int32_t loudness_gain_q12(const loudness_result &r, float target_lufs, float ceiling_dbtp){
+    float gain_db = target_lufs - r.integrated_lufs;
+    gain_db = std::min(gain_db,ceiling_dbtp - r.true_peak_dbtp);  // Peak safe
+    gain_db = std::min(std::max(gain_db,-24.0f),12.0f);
+    return (int32_t)lrintf(4096.0f*powf(10.0f,gain_db/20.0f));
+}
+
+void apply_gain_ramp(int16_t * samples, size_t n, int32_t gain_from, int32_t gain_to){
+    if (n == 0)
+        return;
+
+    // Gain in Q20 so the per-sample increment doesn't round away to zero;
+    // Q12 after the shift.  Branch free so it vectorizes.
+    int32_t g    = gain_from << 8;
+    int32_t step = (int32_t)(((int64_t)(gain_to - gain_from) << 8)/(int64_t)n);
+    for (size_t i=0;i<n;i++){
+        int32_t x = (samples[i]*(g >> 8)) >> 12;
+        samples[i] = (int16_t)std::min(std::max(x,-32768),32767);
+        g += step;
+    }
+}
+
+loudness_cache::loudness_cache(const std::string &file) : cache_file(file) {
+    std::ifstream in(cache_file.c_str());
+    std::string line;
+    while (std::getline(in,line)){
+        // <key> \t <lufs> \t <true peak>
+        size_t t1 = line.find('\t');
+        size_t t2 = line.find('\t',t1 == std::string::npos ? t1 : t1 + 1);
+        if (t1 == std::string::npos || t2 == std::string::npos)
+            continue;
+        loudness_result r;
+        r.integrated_lufs = atof(line.substr(t1 + 1,t2 - t1 - 1).c_str());
+        r.true_peak_dbtp  = atof(line.substr(t2 + 1).c_str());
+        entries[line.substr(0,t1)] = r;
+    }
+}
+
+std::string loudness_cache::key(const std::string &path){
+    boost::system::error_code ec;
+    std::ostringstream k;
+    k << path << "|" << boost::filesystem::file_size(path,ec) << "|" << boost::filesystem::last_write_time(path,ec);
+    return k.str();
+}
+
+bool loudness_cache::lookup(const std::string &path, loudness_result &r){
+    std::string k = key(path);
+    std::lock_guard<std::mutex> lock(m);
+    std::map<std::string,loudness_result>::iterator it = entries.find(k);
+    if (it == entries.end())
+        return false;
+    r = it->second;
+    return true;
+}
+
+void loudness_cache::store(const std::string &path, const loudness_result &r){
+    std::string k = key(path);
+    std::lock_guard<std::mutex> lock(m);
+    entries[k] = r;
+
+    std::ofstream out(cache_file.c_str(),std::ios::app);
+    out << k << "\t" << r.integrated_lufs << "\t" << r.true_peak_dbtp << std::endl;
+}
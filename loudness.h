@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <mutex>
+
+// EBU R128 / ITU-R BS.1770 loudness of a whole track: K-weighted, 400 ms
+// blocks with 75% overlap, absolute (-70 LUFS) and relative (-10 LU) gates.
+// True peak is measured on a 4x oversampled signal.
+
+struct loudness_result{
+    float integrated_lufs;
+    float true_peak_dbtp;
+};
+
+loudness_result analyze_loudness(const int16_t * stereo, size_t frames, int sampling_rate);
+
+// Gain (Q12) that brings a track to target_lufs without pushing its true
+// peak over ceiling_dbtp.
+int32_t loudness_gain_q12(const loudness_result &r, float target_lufs, float ceiling_dbtp);
+
+// Multiply interleaved S16 by a gain that ramps linearly from gain_from to
+// gain_to (Q12) over the buffer, saturating at full scale.  Cheap enough for
+// the audio callback.
+void apply_gain_ramp(int16_t * samples, size_t n, int32_t gain_from, int32_t gain_to);
+
+// Results keyed by path, file size and modification time, kept in memory and
+// in a text file so each file is only ever analyzed once.
+class loudness_cache{
+public:
+
+    loudness_cache(const std::string &file);
+
+    bool lookup(const std::string &path, loudness_result &r);
+    void store(const std::string &path, const loudness_result &r);
+
+private:
+
+    std::string key(const std::string &path);
+
+    std::string cache_file;
+    std::map<std::string,loudness_result> entries;
+    std::mutex m;
+};
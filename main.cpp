@@ -1,10 +1,122 @@
 #define NDEBUG
 #include "player.hpp"
+#include "exporter.hpp"
+#include "benchmark.hpp"
 
 int main(int argc, char ** argv){
 
-    player p;
-    p.set_playlist(argv[1]);
-    
+    // Headless video export:
+    //   audio_vis --export <track.wav> <output.mp4> [visualizer] [fps] [WxH]
+    // Visualizer 4 by default; 3 and 5 carry state between frames and export serially.
+    if (argc >= 4 && !strcmp(argv[1],"--export")){
+        export_settings s;
+        s.track  = argv[2];
+        s.output = argv[3];
+        if (argc > 4)
+            s.vis_idx = atoi(argv[4]);
+        if (argc > 5)
+            s.fps = std::max(1,atoi(argv[5]));
+        if (argc > 6)
+            sscanf(argv[6],"%dx%d",&s.out_width,&s.out_height);
+        return export_video(s);
+    }
+
+    // Visualizer render times, generic against frame size specialized builds:
+    //   audio_vis --bench [WxH] [frames]
+    if (argc >= 2 && !strcmp(argv[1],"--bench")){
+        int w = 512, h = 512, frames = 1000;
+        if (argc > 2)
+            sscanf(argv[2],"%dx%d",&w,&h);
+        if (argc > 3)
+            frames = std::max(1,atoi(argv[3]));
+        return benchmark_visualizers(w,h,frames);
+    }
+
+    // Playback:
+    //   audio_vis [--low-latency | --buffer <samples>] <playlist>
+    // Live input (raw S16LE stereo, or a capture device):
+    //   audio_vis [--rate <hz>] --stdin | --fifo <path> | --capture [device]
+    // Either can also publish frames to shared memory, with or without a window:
+    //   audio_vis [--shm | --shm=/name] [--headless] ...
+    // and show several visualizers tiled together (also toggled with 't'):
+    //   audio_vis --layout 5,6,3,0 ...
+    size_t buffer_size = 4096;
+    int rate = 44100;
+    char * playlist = NULL;
+    const char * live = NULL;
+    const char * live_arg = NULL;
+    const char * shm_name = NULL;
+    bool headless = false;
+    std::vector<int> layout;
+
+    for (int arg=1;arg<argc;arg++){
+        if (!strcmp(argv[arg],"--low-latency"))
+            buffer_size = 256;
+        else if (!strcmp(argv[arg],"--buffer") && arg + 1 < argc)
+            buffer_size = std::max(32,atoi(argv[++arg]));
+        else if (!strcmp(argv[arg],"--rate") && arg + 1 < argc)
+            rate = std::max(1000,atoi(argv[++arg]));
+        else if (!strcmp(argv[arg],"--stdin"))
+            live = argv[arg];
+        else if (!strcmp(argv[arg],"--fifo") && arg + 1 < argc){
+            live = argv[arg];
+            live_arg = argv[++arg];
+        }
+        else if (!strcmp(argv[arg],"--shm"))
+            shm_name = "/audio_vis";
+        else if (!strncmp(argv[arg],"--shm=",6)){
+            // Attached so a following playlist path is never taken for it;
+            // POSIX wants a single leading slash and nothing after it
+            shm_name = argv[arg] + 6;
+            if (shm_name[0] != '/' || shm_name[1] == '\0' || strchr(shm_name + 1,'/') != NULL){
+                std::cout << "Shared memory name must look like /name" << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[arg],"--headless"))
+            headless = true;
+        else if (!strcmp(argv[arg],"--layout") && arg + 1 < argc){
+            char * tok = strtok(argv[++arg],",");
+            while (tok != NULL){
+                layout.push_back(atoi(tok));
+                tok = strtok(NULL,",");
+            }
+        }
+        else if (!strcmp(argv[arg],"--capture")){
+            live = argv[arg];
+            if (arg + 1 < argc && strncmp(argv[arg+1],"--",2))
+                live_arg = argv[++arg];
+        }
+        else
+            playlist = argv[arg];
+    }
+
+    if (playlist == NULL && live == NULL){
+        std::cout << "Usage: " << argv[0] << " [--low-latency | --buffer <samples>] <playlist>" << std::endl;
+        std::cout << "       " << argv[0] << " [--rate <hz>] --stdin | --fifo <path> | --capture [device]" << std::endl;
+        std::cout << "       (either of the above) [--shm | --shm=/name] [--headless] [--layout i,j,...]" << std::endl;
+        std::cout << "       " << argv[0] << " --export <track.wav> <output> [visualizer] [fps] [WxH]" << std::endl;
+        std::cout << "       (visualizer 4 by default; 3 and 5 keep state between frames and export serially)" << std::endl;
+        std::cout << "       " << argv[0] << " --bench [WxH] [frames]" << std::endl;
+        return 1;
+    }
+
+    player p(!headless,shm_name);
+    p.set_buffer_size(buffer_size);
+    if (!layout.empty())
+        p.set_layout(layout);
+
+    if (live != NULL){
+        input_source * in;
+        if (!strcmp(live,"--capture"))
+            in = new capture_source(live_arg,rate,std::min(buffer_size,(size_t)512));
+        else
+            in = new pipe_source(live_arg,rate);
+        p.set_input(in);
+        p.run_live();
+    }
+    else
+        p.set_playlist(playlist);
+
     return 0;
 }
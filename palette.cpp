@@ -0,0 +1,212 @@
+#include "palette.h"
+
+// The shipped build targets baseline x86-64 / arm64, so the SIMD expand
+// can't rely on -mavx2: on x86 it's compiled for AVX2 on its own and picked
+// at runtime, on AArch64 NEON is always there.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PALETTE_AVX2
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define PALETTE_NEON
+#include <arm_neon.h>
+#endif
+
+RgbColor HsvToRgb(HsvColor hsv)
+{
+    RgbColor rgb;
+    unsigned char region, remainder, p, q, t;
+
+    if (hsv.s == 0)
+    {
+        rgb.r = hsv.v;
+        rgb.g = hsv.v;
+        rgb.b = hsv.v;
+        return rgb;
+    }
+
+    region = hsv.h / 43;
+    remainder = (hsv.h - (region * 43)) * 6;
+
+    p = (hsv.v * (255 - hsv.s)) >> 8;
+    q = (hsv.v * (255 - ((hsv.s * remainder) >> 8))) >> 8;
+    t = (hsv.v * (255 - ((hsv.s * (255 - remainder)) >> 8))) >> 8;
+
+    switch (region)
+    {
+        case 0:
+            rgb.r = hsv.v; rgb.g = t; rgb.b = p;
+            break;
+        case 1:
+            rgb.r = q; rgb.g = hsv.v; rgb.b = p;
+            break;
+        case 2:
+            rgb.r = p; rgb.g = hsv.v; rgb.b = t;
+            break;
+        case 3:
+            rgb.r = p; rgb.g = q; rgb.b = hsv.v;
+            break;
+        case 4:
+            rgb.r = t; rgb.g = p; rgb.b = hsv.v;
+            break;
+        default:
+            rgb.r = hsv.v; rgb.g = p; rgb.b = q;
+            break;
+    }
+
+    return rgb;
+}
+
+HsvColor RgbToHsv(RgbColor rgb)
+{
+    HsvColor hsv;
+    unsigned char rgbMin, rgbMax;
+
+    rgbMin = rgb.r < rgb.g ? (rgb.r < rgb.b ? rgb.r : rgb.b) : (rgb.g < rgb.b ? rgb.g : rgb.b);
+    rgbMax = rgb.r > rgb.g ? (rgb.r > rgb.b ? rgb.r : rgb.b) : (rgb.g > rgb.b ? rgb.g : rgb.b);
+
+    hsv.v = rgbMax;
+    if (hsv.v == 0)
+    {
+        hsv.h = 0;
+        hsv.s = 0;
+        return hsv;
+    }
+
+    hsv.s = 255 * long(rgbMax - rgbMin) / hsv.v;
+    if (hsv.s == 0)
+    {
+        hsv.h = 0;
+        return hsv;
+    }
+
+    if (rgbMax == rgb.r)
+        hsv.h = 0 + 43 * (rgb.g - rgb.b) / (rgbMax - rgbMin);
+    else if (rgbMax == rgb.g)
+        hsv.h = 85 + 43 * (rgb.b - rgb.r) / (rgbMax - rgbMin);
+    else
+        hsv.h = 171 + 43 * (rgb.r - rgb.g) / (rgbMax - rgbMin);
+
+    return hsv;
+}
+
+void palette_gradient(uint32_t * lut, HsvColor from, HsvColor to){
+    // Straight line through HSV space; HsvToRgb only runs 256 times here
+    for (int i=0;i<256;i++){
+        HsvColor hsv;
+        hsv.h = from.h + ((to.h - from.h)*i)/255;
+        hsv.s = from.s + ((to.s - from.s)*i)/255;
+        hsv.v = from.v + ((to.v - from.v)*i)/255;
+
+        RgbColor rgb = HsvToRgb(hsv);
+        lut[i] = 0xFF000000 | (rgb.r << 16) | (rgb.g << 8) | rgb.b;
+    }
+}
+
+#ifdef PALETTE_AVX2
+static bool palette_has_avx2(){
+    static const bool has = [](){
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+    return has;
+}
+
+__attribute__((target("avx2")))
+static size_t palette_expand_avx2(const uint8_t * idx, size_t n, const uint32_t * lut, uint8_t offset, uint32_t * out){
+    // 8 pixels at a time: add the offset in 8 bit lanes (so it wraps like
+    // the scalar path), widen to 32 bit and gather from the table
+    size_t i = 0;
+    const __m128i off = _mm_set1_epi8((char)offset);
+    for (;i+8<=n;i+=8){
+        __m128i b   = _mm_add_epi8(_mm_loadl_epi64((const __m128i*)(idx+i)),off);
+        __m256i vi  = _mm256_cvtepu8_epi32(b);
+        __m256i px  = _mm256_i32gather_epi32((const int*)lut,vi,4);
+        _mm256_storeu_si256((__m256i*)(out+i),px);
+    }
+    return i;
+}
+#endif
+
+#ifdef PALETTE_NEON
+typedef uint8x16x4_t palette_tables[4][4];  // [channel][64 entry group]
+
+static void palette_tables_neon(const uint32_t * lut, palette_tables tables){
+    // No gather on NEON: split the table into one 256 byte plane per
+    // channel, loaded as four 64 byte TBL tables each
+    uint8_t planes[4][256];
+    for (int e=0;e<256;e++){
+        for (int c=0;c<4;c++)
+            planes[c][e] = (uint8_t)(lut[e] >> (8*c));
+    }
+    for (int c=0;c<4;c++){
+        for (int g=0;g<4;g++){
+            for (int k=0;k<4;k++)
+                tables[c][g].val[k] = vld1q_u8(&planes[c][64*g + 16*k]);
+        }
+    }
+}
+
+static size_t palette_expand_neon(const uint8_t * idx, size_t n, const palette_tables tables, uint8_t offset, uint32_t * out){
+    // Out of range TBL lanes come back 0, so the four 64 entry lookups
+    // just OR together.  vst4 then interleaves B,G,R,A back into little
+    // endian ARGB pixels.
+    size_t i = 0;
+    const uint8x16_t off = vdupq_n_u8(offset);
+    const uint8x16_t q64 = vdupq_n_u8(64);
+    for (;i+16<=n;i+=16){
+        uint8x16_t b0 = vaddq_u8(vld1q_u8(idx+i),off);
+        uint8x16_t b1 = vsubq_u8(b0,q64);
+        uint8x16_t b2 = vsubq_u8(b1,q64);
+        uint8x16_t b3 = vsubq_u8(b2,q64);
+        uint8x16x4_t px;
+        for (int c=0;c<4;c++){
+            px.val[c] = vorrq_u8(vorrq_u8(vqtbl4q_u8(tables[c][0],b0),vqtbl4q_u8(tables[c][1],b1)),
+                                 vorrq_u8(vqtbl4q_u8(tables[c][2],b2),vqtbl4q_u8(tables[c][3],b3)));
+        }
+        vst4q_u8((uint8_t*)(out+i),px);
+    }
+    return i;
+}
+#endif
+
+static void palette_expand_scalar(const uint8_t * idx, size_t i, size_t n, const uint32_t * lut, uint8_t offset, uint32_t * out){
+    for (;i+4<=n;i+=4){
+        out[i]   = lut[(uint8_t)(idx[i]   + offset)];
+        out[i+1] = lut[(uint8_t)(idx[i+1] + offset)];
+        out[i+2] = lut[(uint8_t)(idx[i+2] + offset)];
+        out[i+3] = lut[(uint8_t)(idx[i+3] + offset)];
+    }
+    for (;i<n;i++)
+        out[i] = lut[(uint8_t)(idx[i] + offset)];
+}
+
+void palette_expand_rows(const uint8_t * idx, int w, int h, const uint32_t * lut, uint8_t offset, uint32_t * out, int stride){
+#if defined(PALETTE_AVX2)
+    bool simd = palette_has_avx2();
+#elif defined(PALETTE_NEON)
+    // Splitting the table costs about as much as expanding a few hundred
+    // pixels; done once here, every row of the frame shares it
+    bool simd = (size_t)w*h >= 1024;
+    palette_tables tables;
+    if (simd)
+        palette_tables_neon(lut,tables);
+#endif
+
+    for (int j=0;j<h;j++){
+        const uint8_t * row_idx = idx + (size_t)j*w;
+        uint32_t * row_out      = out + (size_t)j*stride;
+        size_t i = 0;
+#if defined(PALETTE_AVX2)
+        if (simd)
+            i = palette_expand_avx2(row_idx,w,lut,offset,row_out);
+#elif defined(PALETTE_NEON)
+        if (simd)
+            i = palette_expand_neon(row_idx,w,tables,offset,row_out);
+#endif
+        palette_expand_scalar(row_idx,i,w,lut,offset,row_out);
+    }
+}
+
+void palette_expand(const uint8_t * idx, size_t n, const uint32_t * lut, uint8_t offset, uint32_t * out){
+    palette_expand_rows(idx,(int)n,1,lut,offset,out,(int)n);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct RgbColor
+{
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+} RgbColor;
+
+typedef struct HsvColor
+{
+    unsigned char h;
+    unsigned char s;
+    unsigned char v;
+} HsvColor;
+
+RgbColor HsvToRgb(HsvColor hsv);
+HsvColor RgbToHsv(RgbColor rgb);
+
+// Indexed rendering: visualizers draw 8 bit indices, and a 256 entry ARGB
+// lookup table turns them into pixels at upload time.  Adding an offset to
+// every index while expanding rotates the palette at no extra cost.
+void palette_gradient(uint32_t * lut, HsvColor from, HsvColor to);
+void palette_expand(const uint8_t * idx, size_t n, const uint32_t * lut, uint8_t offset, uint32_t * out);
+// w x h tightly packed indices into a frame whose rows are stride pixels
+// apart (a texture's pitch, a viewport); any table setup happens once
+void palette_expand_rows(const uint8_t * idx, int w, int h, const uint32_t * lut, uint8_t offset, uint32_t * out, int stride);
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdlib.h>
 #include <cstdio>
 #include <iostream>
@@ -7,6 +9,11 @@
 #include <chrono>
 #include <thread>
 #include <random>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <math.h>
+#include <time.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
 
@@ -14,6 +21,13 @@
 
 #include "sdl_wrapper.h"
 #include "visualizers.h"
+#include "worker_pool.hpp"
+#include "playlist_probe.hpp"
+#include "sample_format.h"
+#include "loudness.h"
+#include "input_source.hpp"
+#include "shm_sink.hpp"
+#include "compositor.hpp"
 
 std::random_device rd;     // only used once to initialise (seed) engine
 std::mt19937 rng(rd());    // random-number engine used (Mersenne-Twister in this case)
@@ -34,67 +48,185 @@ enum player_mode{
 //    VIS_EXPERIMENTAL
 //};
 
+// Audio callback health.  Only the callback writes these (apart from the
+// resets done while the device is paused); the event loop reads them.
+struct callback_stats{
+    std::atomic<uint32_t> callbacks{0};
+    std::atomic<uint32_t> xruns{0};         // Callback came more than 1.5 periods after the last one
+    std::atomic<uint64_t> last_counter{0};  // Perf counter at the previous callback, 0 after a pause
+    std::atomic<uint64_t> key_counter{0};   // Perf counter of a keypress waiting to become audible
+    std::atomic<uint64_t> key_served{0};    // Perf counter of the first callback after that keypress
+    uint64_t period_ticks = 0;              // One device buffer in perf counter ticks
+};
+
+// What the visualizer thread is doing.  With adaptive rendering on, only
+// ACTIVE renders at the full frame rate.
+enum render_state{
+    RENDER_ACTIVE,   // Sound playing, window visible
+    RENDER_SILENT,   // Playing, but the signal has been below the silence floor for a while
+    RENDER_PAUSED,   // Nothing playing
+    RENDER_HIDDEN    // Window minimized or hidden, and nobody reading shared memory
+};
+
+// CPU time of the whole process (audio callback and event loop included),
+// split by the render state it was spent in
+struct render_stats{
+    double cpu_s[4]  = {0,0,0,0};
+    double wall_s[4] = {0,0,0,0};
+
+    void add(render_state st, double cpu, double wall){
+        cpu_s[st]  += cpu;
+        wall_s[st] += wall;
+    }
+    void report(){
+        const char * names[] = {"active","silent","paused","hidden"};
+        std::cout << "CPU seconds per minute:";
+        for (int i=0;i<4;i++){
+            if (wall_s[i] > 0.0)
+                std::cout << " " << names[i] << " " << 60.0*cpu_s[i]/wall_s[i]
+                          << " (" << wall_s[i] << " s)";
+        }
+        std::cout << std::endl;
+    }
+};
+
+double process_cpu_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// A decoded track in canonical stereo S16.  Shared so whoever is still
+// reading it (the visualizer, loudness analysis) keeps it alive across a
+// track change; the last owner frees it.
+struct track_buffer{
+    int16_t * samples;
+    size_t bytes;
+
+    track_buffer(int16_t * s, size_t n) : samples(s), bytes(n) {};
+    ~track_buffer(){SDL_free(samples);};
+};
+
 struct song{
-    uint8_t * song;
-    uint32_t total_bytes;
-    uint32_t bytes_played;
+    uint8_t * song = NULL;  // Owned by player::track, read by the callback
+    uint32_t total_bytes = 0;
+    uint32_t bytes_played = 0;
+    callback_stats stats;
+
+    // Loudness normalization, Q12 (4096 is unity).  The event loop sets the
+    // target; the callback ramps towards it across one buffer.
+    std::atomic<int32_t> gain_target{4096};
+    int32_t gain_applied = 4096;
 };
 
 void audio_callback(void * udata, uint8_t * stream, int len){
+    // Runs on the audio thread, possibly every few milliseconds: no I/O, no
+    // allocation, no locks
     song * curr_song = (song *)udata;
-    
-    // Copy new audio into the stream
-    memcpy(stream, &curr_song->song[curr_song->bytes_played],len);
+    callback_stats & st = curr_song->stats;
+
+    uint64_t now  = SDL_GetPerformanceCounter();
+    uint64_t prev = st.last_counter.exchange(now);
+    if (prev != 0 && (now - prev)*2 > st.period_ticks*3)
+        st.xruns++;
+    st.callbacks++;
+
+    uint64_t expected = 0;
+    if (st.key_counter != 0)
+        st.key_served.compare_exchange_strong(expected,now);
+
+    // Copy new audio into the stream, never reading past the end of the
+    // track.  Whatever is left over is silence until the event loop moves
+    // on to the next song.
+    uint32_t played = curr_song->bytes_played;
+    uint32_t avail  = (played < curr_song->total_bytes) ? curr_song->total_bytes - played : 0;
+    uint32_t n      = std::min(avail,(uint32_t)len);
+    if (n > 0)
+        memcpy(stream, &curr_song->song[played], n);
+    if (n < (uint32_t)len)
+        memset(stream + n, 0, len - n);
 
     // Update metadata
-    curr_song->bytes_played += len;
+    curr_song->bytes_played = played + n;
+
+    int32_t gain = curr_song->gain_target;
+    if (gain != 4096 || curr_song->gain_applied != 4096)
+        apply_gain_ramp((int16_t *)stream, len/sizeof(int16_t), curr_song->gain_applied, gain);
+    curr_song->gain_applied = gain;
 }
 
 int visualizer_thread(void * udata);
 //void render_frame_old(int16_t * song, size_t samples, uint32_t * vis_array, int w, int h);
 
-typedef void (*callback)(struct vis_data * v);
+// Everything the 'v' key cycles through (also used by the exporter)
+std::vector<callback> available_visualizations = {simple,simple_bw,hacker,experimental,oscilloscope,oscilloscope_fancy,vectorscope};
 
 class player{
 public:
 
-    player();
+    player(bool show_window = true, const char * shm_name = NULL);
     ~player();
 
     void play();
     void pause();
     void set_playlist(char * s);
+    void set_input(input_source * in){input = in;};  // Deleted along with the player
+    void run_live();
     void set_track(int track);
+    bool load_track(const std::string &path);
+    void open_device();
+    void set_buffer_size(size_t samples){buffer_size = samples;};
+    void report_latency();
+    void request_loudness(const std::string &path);
+    void set_track_gain(const loudness_result &r);
+    void apply_loudness();
     void event_loop();
     void cout_playlist();
     void next_song();
     void prev_song();
 
     void set_visualization(callback ptr_reg_callback); // function that registers callback with render frame
+    void set_layout(const std::vector<int> &vis_indices);
     void (*render_frame)(struct vis_data * v);
 
     // Accessors
     bool is_exiting(){return exiting;};
     bool is_playing(){return playing;};
     bool is_energy_saver(){return energy_saver;};
+    bool is_adaptive(){return adaptive;};
+    bool is_cycling(){return cycling;};
+    bool is_window_visible(){return window_visible;};
+    bool take_redraw(){return needs_redraw.exchange(false);};
     int get_frame_rate(){return frame_rate;};
     size_t get_buffer_size(){return buffer_size;};
     size_t get_sampling_rate(){return sampling_rate;};
     uint32_t * get_visualizer_array(){return visualizer_array;};
     song * get_song(){return &curr_song;};
+    std::shared_ptr<track_buffer> get_track(){return std::atomic_load(&track);};
+    input_source * get_input(){return input;};
+    shm_sink * get_shm(){return shm;};
+    bool has_window(){return window_shown;};
+    bool is_tiled(){return tiled;};
+    std::vector<callback> get_layout();
+    worker_pool * get_pool(){return &pool;};
     int get_height(){return visualizer_height;};
     int get_width(){return visualizer_width;};    
 
 private:
     
     // Visualizer data
-    bool exiting                = false;
+    std::atomic<bool> exiting{false};
+    SDL_Thread * vis_thread     = NULL;
     int curr_vis                = 3;
-    std::vector<callback> visualizations = {simple,simple_bw,hacker,experimental,oscilloscope,oscilloscope_fancy};
+    std::vector<callback> visualizations = available_visualizations;
     int frame_rate              = 24;
     int visualizer_width        = 512;
     int visualizer_height       = 512;
     uint32_t * visualizer_array = NULL;
+    bool window_shown           = true;   // False when running headless
+    shm_sink * shm              = NULL;   // Shared memory frame output, if enabled
+    std::vector<int> layout     = {5,6,3,0};  // Visualizers shown together when tiled
+    std::atomic<bool> tiled{false};
 
     // Playlist/player management
     int curr_track   = 0;
@@ -102,29 +234,78 @@ private:
     bool playing  = false;
     player_mode mode = MODE_NORMAL;
     bool energy_saver = true;
+    bool adaptive = true;                      // Energy saver also slows down for silence, pause and hidden windows
+    std::atomic<bool> window_visible{true};    // Cleared while minimized or hidden
+    std::atomic<bool> needs_redraw{false};     // Exposed while the visualizer isn't rendering
+    std::atomic<bool> cycling{false};          // Rotate indexed visualizers' palettes every frame
+    playlist_prober prober;
+    input_source * input = NULL;  // Live mode when set, no playlist; owned
 
     // Audio buffer management
-    SDL_AudioDeviceID dev;    
+    SDL_AudioDeviceID dev = 0;
     song curr_song;
+    std::shared_ptr<track_buffer> track;  // Swapped with atomic_load/atomic_store
     size_t buffer_size = 4096;
+    size_t device_buffer_size = 0;  // What the device actually gave us
+    uint32_t reported_xruns = 0;
     size_t sampling_rate = 44100;
+
+    // Loudness normalization
+    bool normalize = true;
+    float target_lufs = -18.0f;
+    float ceiling_dbtp = -1.0f;
+    int32_t track_gain = 4096;
+    uint32_t track_generation = 0;  // Drops analysis results for tracks we've moved past
+
+    // Background analysis hands its result over here; only the event loop
+    // applies it, so a late result can't race a track change
+    std::mutex loudness_mutex;
+    bool loudness_ready = false;
+    uint32_t loudness_generation = 0;
+    loudness_result loudness_pending;
+    loudness_cache loudness{std::string(getenv("HOME") ? getenv("HOME") : ".") + "/.audio_vis_loudness"};
+
+    // Declared last so they're destroyed first: running tasks still touch
+    // the members above.  Loudness analysis has a thread of its own so it
+    // never queues behind a playlist scan.
+    worker_pool pool;
+    worker_pool analysis{1};
 };
 
-player::player(){
-    imshow_initialize(visualizer_width,visualizer_height,"color");
+player::player(bool show_window, const char * shm_name) : prober(&pool) {
+    window_shown = show_window;
+    if (window_shown)
+        imshow_initialize(visualizer_width,visualizer_height,"color");
+    else if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_EVENTS) != 0)
+        imshow_log_error(std::cout, "SDL_Init");
+
     visualizer_array = new uint32_t[visualizer_width*visualizer_height];
     memset(visualizer_array,0,visualizer_width*visualizer_height);
+
+    // Builds compiled for this frame size where there are any
+    for (callback & vis : visualizations)
+        vis = specialize(vis,visualizer_width,visualizer_height);
     set_visualization(visualizations[curr_vis]);
-    imshow_update(visualizer_array);
+    if (window_shown)
+        imshow_update(visualizer_array);
+
+    if (shm_name != NULL)
+        shm = new shm_sink(shm_name,visualizer_width,visualizer_height);
     
-    SDL_CreateThread(visualizer_thread,"visualizer_thread",(void*)this);
+    vis_thread = SDL_CreateThread(visualizer_thread,"visualizer_thread",(void*)this);
 }
 player::~player(){    
-    exiting = true;    
-    std::this_thread::sleep_for(std::chrono::milliseconds(200));     // Let the visualizer thread catch up just in case
+    // The visualizer reads the input's ring and everything below, so it has
+    // to be gone before any of them are
+    exiting = true;
+    SDL_WaitThread(vis_thread,NULL);
+    delete input;
+    if (dev > 0)
+        SDL_CloseAudioDevice(dev);
     delete[] visualizer_array;
-    SDL_FreeWAV(curr_song.song);
-    imshow_destroy();
+    delete shm;
+    if (window_shown)
+        imshow_destroy();
 }
 
 void player::event_loop(){
@@ -137,19 +318,53 @@ void player::event_loop(){
         SDL_Event e;
         SDL_Keycode key;
         
-        // Check if we're ready for the next song
-        if (curr_song.bytes_played >= curr_song.total_bytes-buffer_size)
+        // Check if we're ready for the next song.  The callback pads with
+        // silence once the track runs out, so there's no need to jump early.
+        if (input == NULL && curr_song.bytes_played >= curr_song.total_bytes)
             next_song();
 
-        SDL_PollEvent(&e);
+        report_latency();
+        apply_loudness();
+
+        // No event leaves e untouched; don't handle the previous one again
+        if (!SDL_PollEvent(&e))
+            e.type = SDL_FIRSTEVENT;
 
         // User clicks quit
         if (e.type == SDL_QUIT)
             quit = true;
+        // Minimizing or hiding the window lets the visualizer stop rendering
+        else if (e.type == SDL_WINDOWEVENT){
+            switch (e.window.event){
+            case SDL_WINDOWEVENT_HIDDEN:
+            case SDL_WINDOWEVENT_MINIMIZED:
+                window_visible = false;
+                break;
+            case SDL_WINDOWEVENT_SHOWN:
+            case SDL_WINDOWEVENT_RESTORED:
+            case SDL_WINDOWEVENT_MAXIMIZED:
+                window_visible = true;
+                needs_redraw = true;
+                break;
+            case SDL_WINDOWEVENT_EXPOSED:
+                needs_redraw = true;
+                break;
+            }
+        }
         // Keyboard input
         else if (e.type == SDL_KEYDOWN){
             count = 0;            
             key = e.key.keysym.sym;
+
+            // Time until the result of a transport key reaches the speakers;
+            // only for keys that start audio (play, or a track change while
+            // playing), so a pause never reports a latency
+            bool starts_audio = (key == SDLK_SPACE) ? !playing : ((key == SDLK_RIGHT || key == SDLK_LEFT) && playing);
+            if (starts_audio){
+                curr_song.stats.key_served = 0;
+                curr_song.stats.key_counter = SDL_GetPerformanceCounter();
+            }
+
             if (key == SDLK_SPACE){
                 if (playing)
                     pause();
@@ -173,6 +388,34 @@ void player::event_loop(){
                 mode = modes[(num+1)%modes.size()];
                 std::cout << "Mode: " << mode  << std::endl;
             }
+            else if (key == SDLK_b){
+                // Step down through device buffer sizes (wraps back to 4096)
+                // to find the smallest one that doesn't underrun
+                buffer_size = (buffer_size <= 128) ? 4096 : buffer_size/2;
+                open_device();
+                curr_song.stats.xruns = 0;
+                curr_song.stats.callbacks = 0;
+                reported_xruns = 0;
+                std::cout << "Buffer size: " << device_buffer_size << " samples ("
+                          << 1000.0f*device_buffer_size/sampling_rate << " ms)" << std::endl;
+            }
+            else if (key == SDLK_g){
+                normalize = !normalize;
+                curr_song.gain_target = normalize ? (int32_t)track_gain : 4096;
+                std::cout << "Loudness normalization: " << (normalize ? "true":"false") << std::endl;
+            }
+            else if (key == SDLK_a){
+                adaptive = !adaptive;
+                std::cout << "Adaptive rendering: " << (adaptive ? "true":"false") << std::endl;
+            }
+            else if (key == SDLK_c){
+                cycling = !cycling;
+                std::cout << "Palette cycling: " << (cycling ? "true":"false") << std::endl;
+            }
+            else if (key == SDLK_t){
+                tiled = !tiled;
+                std::cout << "Tiled: " << (tiled ? "true":"false") << std::endl;
+            }
             else if (key == SDLK_v){
                 auto num = curr_vis;
                 curr_vis = (num+1)%visualizations.size();
@@ -192,16 +435,20 @@ void player::event_loop(){
             if (count >= 10500)
                 state = 3;
 
+            // Never sleep longer than one device buffer, otherwise a small
+            // buffer buys nothing for key response
+            int buffer_ms = std::max(1,(int)(1000*buffer_size/sampling_rate));
+
             switch (state){
             case 1:{
                 break;
             }
             case 2:{
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::min(10,buffer_ms)));
                 break;
             }
             case 3:{
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::min(100,buffer_ms)));
                 break;
             }
             }
@@ -212,6 +459,7 @@ void player::event_loop(){
 }
 
 void player::play(){
+    curr_song.stats.last_counter = 0;  // The gap across a pause isn't an xrun
     playing = true;
     std::cout << "Playing: " << playing << std::endl;
     SDL_PauseAudioDevice(dev,1-playing); /* start audio playing. */
@@ -224,6 +472,8 @@ void player::pause(){
 }
 
 void player::next_song(){
+    if (playlist.empty())
+        return;
     if (mode == MODE_NORMAL)
         if (curr_track < playlist.size()-1)
             curr_track += 1;
@@ -243,6 +493,8 @@ void player::next_song(){
 }
 
 void player::prev_song(){
+    if (playlist.empty())
+        return;
     if (mode == MODE_NORMAL)
         curr_track = std::max(curr_track-1,0);
     else if (mode == MODE_REPEAT_ALL)
@@ -267,13 +519,27 @@ void player::set_track(int idx){
     bool cleanup_flag = false;
     std::string curr_path;    
     std::string tmp_path;
+    size_t attempts = 0;
     
     while (!is_valid){
+
+        if (attempts++ >= playlist.size()){
+            std::cout << "No playable tracks in playlist." << std::endl;
+            exit(1);
+        }
         
         curr_track = idx;
-        cout_playlist();
-        
         curr_path = playlist[curr_track];        
+
+        // Entries that failed the background scan are skipped, not erased, so
+        // indices stay stable while the scan is still running
+        if (prober.require(curr_track) == PROBE_INVALID){
+            std::cout << "Current track ("  << curr_path << ") is missing or in an unsupported filetype. Skipping." << std::endl;
+            idx = (idx+1)%playlist.size();
+            continue;
+        }
+
+        cout_playlist();
         
         // Handle filetypes.  We're only reading WAVs.
         std::string extension = boost::filesystem::extension(curr_path);
@@ -281,7 +547,7 @@ void player::set_track(int idx){
             // great, we're done
             is_valid = true;
         }
-        else if (extension == ".mp3" || extension == ".MP3"){
+        else{
             // If we've gotten MP3s we want to convert to a temporary WAV
             // and use that instead.
             boost::filesystem::path fp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();    
@@ -291,8 +557,9 @@ void player::set_track(int idx){
             std::cout << "Converting file... "; 
             int ret = system(cmd.c_str());
             if (ret){
-                std::cout << "File could not be converted correctly. Removing." << std::endl;
-                playlist.erase(playlist.begin() + curr_track);
+                std::cout << "File could not be converted correctly. Skipping." << std::endl;
+                prober.mark_invalid(curr_track);
+                idx = (idx+1)%playlist.size();
                 continue;
             }
             else                    
@@ -303,38 +570,166 @@ void player::set_track(int idx){
             cleanup_flag = true;
             is_valid = true;
         }
-        else{
-            std::cout << "Current track ("  << playlist[curr_track] << ") is in an unsupported filetype. Removing." << std::endl;
-            playlist.erase(playlist.begin() + curr_track);
-            idx =-1;
+
+        if (!load_track(curr_path)){
+            std::cout << "Current track ("  << playlist[curr_track] << ") could not be loaded. Skipping." << std::endl;
+            prober.mark_invalid(curr_track);
+            if (cleanup_flag)
+                remove(tmp_path.c_str());
+            cleanup_flag = false;
+            is_valid = false;
+            idx = (idx+1)%playlist.size();
         }
     }
 
-    SDL_AudioSpec wav;
-    SDL_AudioSpec want,have;
+    open_device();
+    request_loudness(playlist[curr_track]);
 
-    curr_song.bytes_played = 0;
-    SDL_LoadWAV(curr_path.c_str(), &wav, &curr_song.song, &curr_song.total_bytes);
+    // Handle any "cleanup tasks" (resume playing or delete the temporary wav file)
+    if (play_state == true)
+        play();
+
+    if (cleanup_flag)
+        remove(tmp_path.c_str());
+}
+
+void player::open_device(){
+
+    bool play_state = playing;
+    if (dev>0){
+        SDL_CloseAudioDevice(dev);
+        dev = 0;
+    }
 
-    SDL_memcpy(&want,&wav,sizeof(wav));
+    // Tracks are always stored as interleaved stereo S16; let SDL convert to
+    // whatever the device actually wants
+    SDL_AudioSpec want,have;
+    SDL_zero(want);
+    want.freq     = sampling_rate;
+    want.format   = AUDIO_S16SYS;
+    want.channels = 2;
     want.samples  = buffer_size; 
     want.callback = audio_callback;
     want.userdata = &curr_song;
 
-    if (dev>0)
-        SDL_CloseAudioDevice(dev);
-
-    dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+    dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
     if (dev == 0) {
         SDL_Log("Failed to open audio: %s", SDL_GetError());
+        return;
     }
 
-    // Handle any "cleanup tasks" (resume playing or delete the temporary wav file)
-    if (play_state == true)
-        play();
+    device_buffer_size = have.samples;
+    curr_song.stats.period_ticks = SDL_GetPerformanceFrequency()*have.samples/have.freq;
+    curr_song.stats.last_counter = 0;
 
-    if (cleanup_flag)
-        remove(tmp_path.c_str());
+    if (play_state)
+        SDL_PauseAudioDevice(dev,0);
+}
+
+void player::report_latency(){
+    callback_stats & st = curr_song.stats;
+
+    uint64_t served = st.key_served;
+    if (served != 0){
+        // The block written by that first callback still has to drain
+        // through one device buffer before it's heard
+        uint64_t freq = SDL_GetPerformanceFrequency();
+        float callback_ms = 1000.0f*(served - st.key_counter)/freq;
+        float buffer_ms   = 1000.0f*device_buffer_size/sampling_rate;
+        std::cout << "Keypress to audible: " << callback_ms + buffer_ms << " ms (callback "
+                  << callback_ms << " ms + buffer " << buffer_ms << " ms)" << std::endl;
+        st.key_counter = 0;
+        st.key_served  = 0;
+    }
+
+    uint32_t xruns = st.xruns;
+    if (xruns != reported_xruns){
+        std::cout << "Audio xruns: " << xruns << " in " << st.callbacks << " callbacks at "
+                  << device_buffer_size << " samples" << std::endl;
+        reported_xruns = xruns;
+    }
+}
+
+void player::request_loudness(const std::string &path){
+
+    uint32_t generation = ++track_generation;
+    track_gain = 4096;
+    curr_song.gain_target = 4096;
+
+    loudness_result r;
+    if (loudness.lookup(path,r)){
+        set_track_gain(r);
+        return;
+    }
+
+    // Analyze in the background, sharing the decoded track rather than
+    // copying it; playback starts at unity gain and ramps to the normalized
+    // level once the event loop picks the result up
+    std::shared_ptr<track_buffer> t = std::atomic_load(&track);
+    int rate = sampling_rate;
+    analysis.submit([this,t,rate,path,generation]{
+        loudness_result r = analyze_loudness(t->samples,t->bytes/(2*sizeof(int16_t)),rate);
+        loudness.store(path,r);
+        std::lock_guard<std::mutex> lock(loudness_mutex);
+        loudness_pending    = r;
+        loudness_generation = generation;
+        loudness_ready      = true;
+    });
+}
+
+void player::apply_loudness(){
+    loudness_result r;
+    {
+        std::lock_guard<std::mutex> lock(loudness_mutex);
+        if (!loudness_ready)
+            return;
+        loudness_ready = false;
+        if (loudness_generation != track_generation)
+            return;
+        r = loudness_pending;
+    }
+    set_track_gain(r);
+}
+
+void player::set_track_gain(const loudness_result &r){
+    int32_t gain = loudness_gain_q12(r,target_lufs,ceiling_dbtp);
+    track_gain = gain;
+    if (normalize)
+        curr_song.gain_target = gain;
+    std::cout << "Loudness: " << r.integrated_lufs << " LUFS, true peak " << r.true_peak_dbtp
+              << " dBTP, gain " << 20.0f*log10f(gain/4096.0f) << " dB" << std::endl;
+}
+
+bool player::load_track(const std::string &path){
+
+    SDL_AudioSpec wav;
+    uint8_t * wav_buffer;
+    uint32_t wav_bytes;
+
+    if (SDL_LoadWAV(path.c_str(), &wav, &wav_buffer, &wav_bytes) == NULL){
+        imshow_log_error(std::cout,"SDL_LoadWAV");
+        return false;
+    }
+
+    // Float, 32 bit, mono and surround files all end up as stereo S16 here
+    int16_t * canonical;
+    size_t frames = convert_to_canonical(wav_buffer, wav_bytes, wav.format, wav.channels, &canonical);
+    SDL_FreeWAV(wav_buffer);
+    if (frames == 0){
+        std::cout << "Unsupported sample format (format " << wav.format << ", " << (int)wav.channels << " channels)" << std::endl;
+        return false;
+    }
+
+    // set_track paused the device, so the callback isn't reading the old
+    // buffer; the visualizer holds its own reference for the frame it's on,
+    // and the previous track is freed once nobody does
+    std::shared_ptr<track_buffer> t = std::make_shared<track_buffer>(canonical,frames*2*sizeof(int16_t));
+    std::atomic_store(&track,t);
+    curr_song.bytes_played = 0;
+    curr_song.song         = (uint8_t *)t->samples;
+    curr_song.total_bytes  = t->bytes;
+    sampling_rate          = wav.freq;
+    return true;
 }
 
 void player::set_playlist(char * s){
@@ -346,17 +741,34 @@ void player::set_playlist(char * s){
         playlist.push_back(tmp);
     }
 
+    // Validate everything in the background; set_track probes the first
+    // entry itself so playback doesn't wait on the scan
+    prober.start(playlist);
+
     // Set the first track and launch the event loop
     curr_track = 0;
     set_track(curr_track);
     event_loop();
 }
 
+void player::run_live(){
+
+    // Visualize whatever the input source delivers until the user quits
+    if (!input->start())
+        return;
+    sampling_rate = input->get_sampling_rate();
+    playing = true;
+    event_loop();
+    input->stop();
+}
+
 void player::cout_playlist(){
     std::cout << "Current tracklist:" << std::endl;
     for(int i=0;i<playlist.size();i++){
         if (i == curr_track)
             std::cout << " -> ";
+        else if (prober.get(i) == PROBE_INVALID)
+            std::cout << "  x ";
         else
             std::cout << "    ";
         std::cout <<  i << ": " <<  playlist[i] << std::endl;
@@ -378,6 +790,7 @@ int visualizer_thread(void * udata){
     size_t bytes_per_frame = 4*samples_per_frame;
 
     int16_t * frame_buffer = new int16_t[bytes_per_frame];
+    uint8_t * index_array  = new uint8_t[p->get_width()*p->get_height()];
 
     // Always displaying something until time to quit
     int frame_ticker = 0;
@@ -386,41 +799,165 @@ int visualizer_thread(void * udata){
     struct vis_data v;
     v.w         = p->get_width();
     v.h         = p->get_height();
+    v.stride    = p->get_width();
+    v.pool      = p->get_pool();
+    float peaks[2] = {0.0f,0.0f};
+    v.peaks     = peaks;
     v.song      = frame_buffer;
     v.samples   = samples_per_frame;
     v.vis_array = p->get_visualizer_array();
+    v.index_array = index_array;
+
+    // Tiled view; rebuilt (and the frame cleared) whenever it's switched on
+    compositor tiles;
+    bool was_tiled = false;
+    uint8_t cycle = 0;  // Palette rotation, advanced once per rendered frame
+    int report_ticker = 0;
+
+    // Adaptive rendering (energy saver and 'a'): full frame rate while there's
+    // sound, a few frames a second through silence, nothing while paused or
+    // hidden.  Those states poll every few milliseconds, so sound, play or the
+    // window coming back restores the full rate on the next poll.
+    const float silent_millis  = 250.0f;
+    const float poll_millis    = 10.0f;
+    const double silence_rms   = 32.0;  // About -60 dBFS
+    const double silence_hold  = 1.0;   // Seconds below that before slowing down
+    auto last_sound  = std::chrono::steady_clock::now();
+    auto last_render = last_sound - std::chrono::hours(1);
+
+    render_stats stats;
+    double stats_cpu  = process_cpu_seconds();
+    auto stats_wall   = std::chrono::steady_clock::now();
+    auto stats_report = stats_wall;
 
     while (!(p->is_exiting())){
         auto start = std::chrono::high_resolution_clock::now();
-        if (!p->is_playing()){
-            // Render "silence" (generate some noise to display, but don't actually send to audio buffer)
-            // Max val of int16: -32768 through 32767
-            float noise_magnitude_percent = 2;
-            int noise_limit = 32767/100*noise_magnitude_percent;
-            for (int i=0;i<2*samples_per_frame;i++){ // factor of 2 since we have LR channels
-                frame_buffer[i] = rand()%((noise_limit - (-noise_limit))+1) + (-noise_limit);
-            }
+        auto now   = std::chrono::steady_clock::now();
+
+        // Look at this frame's audio first; it's only consumed (frame_ticker)
+        // once it's actually rendered
+        bool playing = p->is_playing();
+        if (playing && p->get_input() != NULL){
+            // Live input: always the newest window, silence once it's over
+            if (p->get_input()->has_ended())
+                memset(frame_buffer,0,bytes_per_frame);
+            else
+                p->get_input()->get_ring()->read_latest(frame_buffer,samples_per_frame);
         }
-        else{
+        else if (playing){
+            std::shared_ptr<track_buffer> t = p->get_track();
             if (s->bytes_played != prev_byte_played){
                 prev_byte_played = s->bytes_played;
                 frame_ticker = 0;
             }
-            // Copy data into the frame audio buffer and render
-            memcpy(frame_buffer,&s->song[prev_byte_played + frame_ticker * bytes_per_frame],bytes_per_frame);
-            frame_ticker++;
+            // Copy data into the frame audio buffer and render.  Near the end
+            // of the track only part of a frame is left; pad with silence.
+            size_t offset = prev_byte_played + frame_ticker * bytes_per_frame;
+            size_t avail  = (t && offset < t->bytes) ? t->bytes - offset : 0;
+            size_t n      = std::min(avail,bytes_per_frame);
+            if (n > 0)
+                memcpy(frame_buffer,(uint8_t *)t->samples + offset,n);
+            memset((uint8_t *)frame_buffer + n,0,bytes_per_frame - n);
         }
-        //(p->render_frame)(frame_buffer,samples_per_frame,p->get_visualizer_array(),p->get_width(),p->get_height());
-        (p->render_frame)(&v);
-        imshow_update(p->get_visualizer_array());
+
+        render_state state = RENDER_ACTIVE;
+        bool visible = p->has_window() && p->is_window_visible();
+        if (!visible && p->get_shm() == NULL)
+            state = RENDER_HIDDEN;
+        else if (!playing)
+            state = RENDER_PAUSED;
+        else{
+            double sum = 0.0;
+            for (size_t i=0;i<2*samples_per_frame;i++)
+                sum += (double)frame_buffer[i]*frame_buffer[i];
+            if (sqrt(sum/(2*samples_per_frame)) >= silence_rms)
+                last_sound = now;
+            else if (std::chrono::duration<double>(now - last_sound).count() > silence_hold)
+                state = RENDER_SILENT;
+        }
+
+        bool adaptive = p->is_energy_saver() && p->is_adaptive();
+        bool render = true;
+        if (adaptive){
+            if (state == RENDER_SILENT)
+                render = std::chrono::duration<float,std::milli>(now - last_render).count() >= silent_millis;
+            else if (state != RENDER_ACTIVE)
+                render = false;
+        }
+
+        if (render){
+            last_render = now;
+            if (!playing){
+                // Render "silence" (generate some noise to display, but don't actually send to audio buffer)
+                // Max val of int16: -32768 through 32767
+                float noise_magnitude_percent = 2;
+                int noise_limit = 32767/100*noise_magnitude_percent;
+                for (int i=0;i<2*samples_per_frame;i++){ // factor of 2 since we have LR channels
+                    frame_buffer[i] = rand()%((noise_limit - (-noise_limit))+1) + (-noise_limit);
+                }
+            }
+            else if (p->get_input() == NULL)
+                frame_ticker++;
+            if (p->is_cycling())
+                cycle++;
+
+            //(p->render_frame)(frame_buffer,samples_per_frame,p->get_visualizer_array(),p->get_width(),p->get_height());
+            v.indexed = false;
+            bool tile = p->is_tiled();
+            if (tile){
+                if (!was_tiled)
+                    tiles.set_layout(p->get_layout(),p->get_width(),p->get_height());
+                tiles.render(frame_buffer,samples_per_frame,p->get_visualizer_array(),p->get_pool(),cycle);
+                if (++report_ticker >= 5*p->get_frame_rate()){
+                    tiles.report();
+                    report_ticker = 0;
+                }
+            }
+            else{
+                (p->render_frame)(&v);
+                v.palette_offset += cycle;  // Free: it's applied during the expand anyway
+            }
+            was_tiled = tile;
+            if (p->get_shm() != NULL){
+                if (v.indexed)
+                    p->get_shm()->publish_indexed(v.index_array,v.palette,v.palette_offset);
+                else
+                    p->get_shm()->publish(p->get_visualizer_array());
+            }
+        }
+
+        // Upload new frames, or the last one again if the window was exposed
+        // while rendering was frozen
+        if (visible && (p->take_redraw() || render)){
+            if (v.indexed)
+                imshow_update_indexed(v.index_array,v.palette,v.palette_offset);
+            else
+                imshow_update(p->get_visualizer_array());
+        }
+
         auto end = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end-start);
-        if (p->is_energy_saver())
-            std::this_thread::sleep_for(std::chrono::milliseconds((int)millis)-duration);
+        if (p->is_energy_saver()){
+            float wait = (adaptive && state != RENDER_ACTIVE) ? poll_millis : millis;
+            std::this_thread::sleep_for(std::chrono::milliseconds((int)wait)-duration);
+        }
+
+        // Everything the process spent during this iteration, sleep included
+        double cpu = process_cpu_seconds();
+        auto wall  = std::chrono::steady_clock::now();
+        stats.add(state,cpu - stats_cpu,std::chrono::duration<double>(wall - stats_wall).count());
+        stats_cpu  = cpu;
+        stats_wall = wall;
+        if (wall - stats_report >= std::chrono::minutes(1)){
+            stats.report();
+            stats_report = wall;
+        }
     }
 
+    stats.report();
     std::cout << "Visualizer shutting down" << std::endl;
     delete[] frame_buffer;
+    delete[] index_array;
 
     return 0;
 }
@@ -428,3 +965,22 @@ int visualizer_thread(void * udata){
 void player::set_visualization(callback render_frame_callback){
     render_frame = render_frame_callback;
 }
+
+void player::set_layout(const std::vector<int> &vis_indices){
+    // Indices into available_visualizations; anything out of range is dropped
+    layout.clear();
+    for (int i : vis_indices){
+        if (i >= 0 && i < (int)visualizations.size())
+            layout.push_back(i);
+        else
+            std::cout << "No visualizer " << i << ", leaving it out of the layout" << std::endl;
+    }
+    tiled = !layout.empty();
+}
+
+std::vector<callback> player::get_layout(){
+    std::vector<callback> vis;
+    for (int i : layout)
+        vis.push_back(visualizations[i]);
+    return vis;
+}
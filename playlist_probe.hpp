@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdlib.h>
+#include <cstdio>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+
+#include "worker_pool.hpp"
+
+// Background validation of playlist entries.  Each entry gets a stat and a
+// peek at the first few bytes of the container (no decoding), so broken or
+// unsupported files are known about before set_track ever reaches them.
+
+enum probe_result{
+    PROBE_PENDING,
+    PROBE_VALID,
+    PROBE_INVALID
+};
+
+probe_result probe_file(const std::string &path){
+
+    boost::system::error_code ec;
+    if (!boost::filesystem::is_regular_file(path,ec) || ec)
+        return PROBE_INVALID;
+    if (boost::filesystem::file_size(path,ec) < 12 || ec)
+        return PROBE_INVALID;
+
+    uint8_t header[12];
+    FILE * f = fopen(path.c_str(),"rb");
+    if (f == NULL)
+        return PROBE_INVALID;
+    size_t n = fread(header,1,sizeof(header),f);
+    fclose(f);
+    if (n != sizeof(header))
+        return PROBE_INVALID;
+
+    // Same extensions set_track knows how to handle
+    std::string extension = boost::filesystem::extension(path);
+    if (extension == ".wav" || extension == ".WAV"){
+        if (!memcmp(header,"RIFF",4) && !memcmp(header+8,"WAVE",4))
+            return PROBE_VALID;
+    }
+    else if (extension == ".mp3" || extension == ".MP3"){
+        // Either an ID3v2 tag or an MPEG audio frame sync
+        if (!memcmp(header,"ID3",3))
+            return PROBE_VALID;
+        if (header[0] == 0xFF && (header[1] & 0xE0) == 0xE0)
+            return PROBE_VALID;
+    }
+
+    return PROBE_INVALID;
+}
+
+class playlist_prober{
+public:
+
+    playlist_prober(worker_pool * p) : pool(p) {};
+    ~playlist_prober(){cancel();};
+
+    void start(const std::vector<std::string> &playlist);
+    void cancel();
+
+    probe_result get(size_t idx);     // Non-blocking, may return PROBE_PENDING
+    probe_result require(size_t idx); // Probes inline if the scan hasn't reached idx yet
+    void mark_invalid(size_t idx);
+
+private:
+
+    struct probe_state{
+        std::vector<std::string> paths;
+        std::vector<uint8_t> results;
+        std::mutex m;
+        std::atomic<bool> cancelled;
+        std::atomic<size_t> remaining;
+        size_t n_invalid;
+        std::chrono::high_resolution_clock::time_point start;
+    };
+
+    static void probe_chunk(std::shared_ptr<probe_state> st, size_t begin, size_t end);
+
+    worker_pool * pool;
+    std::shared_ptr<probe_state> state;
+    static const size_t chunk_size = 256;
+};
+
+void playlist_prober::start(const std::vector<std::string> &playlist){
+    cancel();
+
+    state = std::make_shared<probe_state>();
+    state->paths     = playlist;
+    state->results.assign(playlist.size(),PROBE_PENDING);
+    state->cancelled = false;
+    state->n_invalid = 0;
+    state->start     = std::chrono::high_resolution_clock::now();
+
+    size_t n_chunks = (playlist.size() + chunk_size - 1)/chunk_size;
+    state->remaining = n_chunks;
+
+    // Chunks are queued in playlist order so the front of the list (where
+    // playback starts) is validated first
+    for (size_t i=0;i<n_chunks;i++){
+        size_t begin = i*chunk_size;
+        size_t end   = std::min(begin + chunk_size,playlist.size());
+        std::shared_ptr<probe_state> st = state;
+        pool->submit([st,begin,end]{probe_chunk(st,begin,end);});
+    }
+}
+
+void playlist_prober::cancel(){
+    if (state)
+        state->cancelled = true;
+    state.reset();
+}
+
+void playlist_prober::probe_chunk(std::shared_ptr<probe_state> st, size_t begin, size_t end){
+    for (size_t i=begin;i<end;i++){
+        if (st->cancelled)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(st->m);
+            if (st->results[i] != PROBE_PENDING)
+                continue;
+        }
+
+        probe_result r = probe_file(st->paths[i]);
+
+        std::lock_guard<std::mutex> lock(st->m);
+        if (st->results[i] == PROBE_PENDING){
+            st->results[i] = r;
+            if (r == PROBE_INVALID)
+                st->n_invalid++;
+        }
+    }
+
+    if (st->remaining.fetch_sub(1) == 1){
+        auto end_time = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - st->start);
+        std::lock_guard<std::mutex> lock(st->m);
+        std::cout << "Playlist scan: " << st->paths.size() << " entries, " << st->n_invalid
+                  << " unusable (" << duration.count() << " ms)" << std::endl;
+    }
+}
+
+probe_result playlist_prober::get(size_t idx){
+    if (!state || idx >= state->results.size())
+        return PROBE_INVALID;
+    std::lock_guard<std::mutex> lock(state->m);
+    return (probe_result)state->results[idx];
+}
+
+probe_result playlist_prober::require(size_t idx){
+    probe_result r = get(idx);
+    if (r != PROBE_PENDING)
+        return r;
+
+    // Don't wait behind the queue, just do this one now
+    r = probe_file(state->paths[idx]);
+
+    std::lock_guard<std::mutex> lock(state->m);
+    if (state->results[idx] == PROBE_PENDING){
+        state->results[idx] = r;
+        if (r == PROBE_INVALID)
+            state->n_invalid++;
+    }
+    return (probe_result)state->results[idx];
+}
+
+void playlist_prober::mark_invalid(size_t idx){
+    if (!state || idx >= state->results.size())
+        return;
+    std::lock_guard<std::mutex> lock(state->m);
+    if (state->results[idx] != PROBE_INVALID)
+        state->n_invalid++;
+    state->results[idx] = PROBE_INVALID;
+}
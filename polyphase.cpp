@@ -0,0 +1,49 @@
+#include "polyphase.h"
+#include <math.h>
+
+polyphase_interpolator::polyphase_interpolator(int f, int t) : factor(f), taps(t) {
+
+    coeffs.resize(factor*taps);
+
+    // Output phase p sits p/factor of the way between two input samples.
+    // Tap k looks at input i - taps/2 + 1 + k, i.e. at distance d from the
+    // output position.  Hann windowed sinc, each phase normalized to unity
+    // DC gain (phase 0 reduces to a plain copy).
+    for (int p=0;p<factor;p++){
+        float sum = 0.0f;
+        for (int k=0;k<taps;k++){
+            float d = (float)p/(float)factor + taps/2 - 1 - k;
+            float sinc = (d == 0.0f) ? 1.0f : sinf(M_PI*d)/(M_PI*d);
+            float x = d/(taps/2);
+            float window = (fabsf(x) < 1.0f) ? 0.5f*(1.0f + cosf(M_PI*x)) : 0.0f;
+            coeffs[p*taps + k] = sinc*window;
+            sum += sinc*window;
+        }
+        for (int k=0;k<taps;k++)
+            coeffs[p*taps + k] /= sum;
+    }
+}
+
+void polyphase_interpolator::process(const int16_t * in, size_t n, int stride, size_t begin, size_t end, float * out){
+
+    // Pull the channel (plus filter history on both sides) into a contiguous
+    // float buffer so the inner loop is a plain dot product
+    size_t half = taps/2;
+    size_t len  = end - begin + taps;
+    std::vector<float> x(len);
+    for (size_t j=0;j<len;j++){
+        long src = (long)begin + (long)j - (long)half + 1;
+        x[j] = (src >= 0 && src < (long)n) ? in[src*stride] : 0.0f;
+    }
+
+    for (size_t i=0;i<end-begin;i++){
+        const float * xi = &x[i];
+        for (int p=0;p<factor;p++){
+            const float * c = &coeffs[p*taps];
+            float acc = 0.0f;
+            for (int k=0;k<taps;k++)
+                acc += c[k]*xi[k];
+            out[i*factor + p] = acc;
+        }
+    }
+}
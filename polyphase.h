@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+// Integer-factor upsampler.  The windowed-sinc prototype filter is split into
+// `factor` phases of `taps` coefficients each, so every output sample is one
+// short dot product instead of a pass over the zero-stuffed signal.
+
+class polyphase_interpolator{
+public:
+
+    polyphase_interpolator(int factor, int taps = 8);
+
+    int get_factor(){return factor;};
+
+    // Upsample input samples [begin,end) of one channel of an interleaved
+    // buffer holding n frames (channel stride `stride`).  Writes
+    // (end-begin)*factor values to out.  Samples outside [0,n) count as zero.
+    void process(const int16_t * in, size_t n, int stride, size_t begin, size_t end, float * out);
+
+private:
+
+    int factor;
+    int taps;
+    std::vector<float> coeffs; // factor*taps, one phase after another
+};
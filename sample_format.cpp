@@ -0,0 +1,222 @@
+#include "sample_format.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Stage 1: source samples -> int16, channel layout untouched
+
+typedef void (*to_s16_kernel)(const uint8_t * src, size_t n, int16_t * dst);
+
+static void u8_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    for (size_t i=0;i<n;i++)
+        dst[i] = (int16_t)((src[i] - 128) << 8);
+}
+
+static void s8_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    for (size_t i=0;i<n;i++)
+        dst[i] = (int16_t)(((int8_t)src[i]) << 8);
+}
+
+static void s16_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    memcpy(dst,src,n*sizeof(int16_t));
+}
+
+static void s16swap_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    const uint16_t * s = (const uint16_t *)src;
+    for (size_t i=0;i<n;i++)
+        dst[i] = (int16_t)((s[i] >> 8) | (s[i] << 8));
+}
+
+static void s32_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    const int32_t * s = (const int32_t *)src;
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (;i+8<=n;i+=8){
+        __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s+i)),16);
+        __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(s+i+4)),16);
+        _mm_storeu_si128((__m128i*)(dst+i),_mm_packs_epi32(a,b));
+    }
+#endif
+    for (;i<n;i++)
+        dst[i] = (int16_t)(s[i] >> 16);
+}
+
+static void s32be_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    // Big endian: the top 16 bits are the first two bytes
+    for (size_t i=0;i<n;i++)
+        dst[i] = (int16_t)((src[4*i] << 8) | src[4*i+1]);
+}
+
+static void f32_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    const float * s = (const float *)src;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    const __m128 lo    = _mm_set1_ps(-1.0f);
+    const __m128 hi    = _mm_set1_ps(1.0f);
+    for (;i+8<=n;i+=8){
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(s+i),lo),hi);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(s+i+4),lo),hi);
+        __m128i ia = _mm_cvtps_epi32(_mm_mul_ps(a,scale));
+        __m128i ib = _mm_cvtps_epi32(_mm_mul_ps(b,scale));
+        _mm_storeu_si128((__m128i*)(dst+i),_mm_packs_epi32(ia,ib));
+    }
+#endif
+    for (;i<n;i++){
+        float x = std::min(std::max(s[i],-1.0f),1.0f);
+        dst[i] = (int16_t)lrintf(x*32767.0f);
+    }
+}
+
+static void f32be_to_s16(const uint8_t * src, size_t n, int16_t * dst){
+    for (size_t i=0;i<n;i++){
+        uint32_t u = ((uint32_t)src[4*i] << 24) | ((uint32_t)src[4*i+1] << 16) |
+                     ((uint32_t)src[4*i+2] << 8) | (uint32_t)src[4*i+3];
+        float x;
+        memcpy(&x,&u,sizeof(x));
+        x = std::min(std::max(x,-1.0f),1.0f);
+        dst[i] = (int16_t)lrintf(x*32767.0f);
+    }
+}
+
+static to_s16_kernel pick_to_s16(SDL_AudioFormat format){
+    bool big_endian = SDL_AUDIO_ISBIGENDIAN(format) != 0;
+    bool native     = big_endian == (SDL_BYTEORDER == SDL_BIG_ENDIAN);
+
+    if (format == AUDIO_U8)
+        return u8_to_s16;
+    if (format == AUDIO_S8)
+        return s8_to_s16;
+    if (SDL_AUDIO_BITSIZE(format) == 16 && SDL_AUDIO_ISSIGNED(format))
+        return native ? s16_to_s16 : s16swap_to_s16;
+    if (SDL_AUDIO_BITSIZE(format) == 32 && SDL_AUDIO_ISFLOAT(format))
+        return native ? f32_to_s16 : (big_endian ? f32be_to_s16 : NULL);
+    if (SDL_AUDIO_BITSIZE(format) == 32 && SDL_AUDIO_ISSIGNED(format))
+        return native ? s32_to_s16 : (big_endian ? s32be_to_s16 : NULL);
+    return NULL;
+}
+
+// Stage 2: int16 with C channels -> interleaved stereo
+
+typedef void (*downmix_kernel)(const int16_t * src, size_t n_frames, int16_t * dst);
+
+static void mono_to_stereo(const int16_t * src, size_t n_frames, int16_t * dst){
+    for (size_t i=0;i<n_frames;i++){
+        dst[2*i]   = src[i];
+        dst[2*i+1] = src[i];
+    }
+}
+
+static void stereo_to_stereo(const int16_t * src, size_t n_frames, int16_t * dst){
+    memcpy(dst,src,2*n_frames*sizeof(int16_t));
+}
+
+// ITU-R BS.775 downmix in SDL's channel order for each count.  Fronts go
+// straight through, centre and surrounds go in at -3 dB and LFE is dropped.
+// No normalization: loud multichannel material saturates instead of every
+// file getting quieter.  Coefficients are Q14, one row per channel count.
+static const int32_t unity = 16384;
+static const int32_t m3db  = 11585;  // 0.7071
+
+static const int32_t downmix_l[9][8] = {
+    {}, {}, {},
+    {unity, 0, 0},                                  // FL FR LFE
+    {unity, 0, m3db, 0},                            // FL FR BL BR
+    {unity, 0, 0, m3db, 0},                         // FL FR LFE BL BR
+    {unity, 0, m3db, 0, m3db, 0},                   // FL FR FC LFE BL BR
+    {unity, 0, m3db, 0, m3db, m3db, 0},             // FL FR FC LFE BC SL SR
+    {unity, 0, m3db, 0, m3db, 0, m3db, 0}           // FL FR FC LFE BL BR SL SR
+};
+
+static const int32_t downmix_r[9][8] = {
+    {}, {}, {},
+    {0, unity, 0},
+    {0, unity, 0, m3db},
+    {0, unity, 0, 0, m3db},
+    {0, unity, m3db, 0, 0, m3db},
+    {0, unity, m3db, 0, m3db, 0, m3db},
+    {0, unity, m3db, 0, 0, m3db, 0, m3db}
+};
+
+template <int C>
+static void multi_to_stereo(const int16_t * src, size_t n_frames, int16_t * dst){
+    const int32_t * to_l = downmix_l[C];
+    const int32_t * to_r = downmix_r[C];
+    for (size_t i=0;i<n_frames;i++){
+        const int16_t * f = src + i*C;
+        int32_t l = 0, r = 0;
+        for (int c=0;c<C;c++){
+            l += f[c]*to_l[c];
+            r += f[c]*to_r[c];
+        }
+        dst[2*i]   = (int16_t)std::min(std::max(l >> 14,-32768),32767);
+        dst[2*i+1] = (int16_t)std::min(std::max(r >> 14,-32768),32767);
+    }
+}
+
+static downmix_kernel pick_downmix(int channels){
+    static const downmix_kernel kernels[9] = {
+        NULL,
+        mono_to_stereo,
+        stereo_to_stereo,
+        multi_to_stereo<3>,
+        multi_to_stereo<4>,
+        multi_to_stereo<5>,
+        multi_to_stereo<6>,
+        multi_to_stereo<7>,
+        multi_to_stereo<8>
+    };
+    if (channels < 1 || channels > 8)
+        return NULL;
+    return kernels[channels];
+}
+
+bool sample_format_supported(SDL_AudioFormat format, int channels){
+    return pick_to_s16(format) != NULL && pick_downmix(channels) != NULL;
+}
+
+bool convert_block(const uint8_t * src, size_t n_frames, SDL_AudioFormat format, int channels, int16_t * dst){
+    to_s16_kernel to_s16    = pick_to_s16(format);
+    downmix_kernel downmix = pick_downmix(channels);
+    if (to_s16 == NULL || downmix == NULL)
+        return false;
+
+    // Stereo S16 is already canonical
+    if (to_s16 == s16_to_s16 && downmix == stereo_to_stereo){
+        memcpy(dst,src,2*n_frames*sizeof(int16_t));
+        return true;
+    }
+
+    // Work through a cache sized scratch block so the two stages don't make
+    // a second trip to memory
+    const size_t block = 2048;
+    int16_t scratch[block*8];
+    size_t bytes_per_sample = SDL_AUDIO_BITSIZE(format)/8;
+
+    for (size_t i=0;i<n_frames;i+=block){
+        size_t n = std::min(block,n_frames - i);
+        to_s16(src + i*channels*bytes_per_sample,n*channels,scratch);
+        downmix(scratch,n,dst + 2*i);
+    }
+    return true;
+}
+
+size_t convert_to_canonical(const uint8_t * src, size_t bytes, SDL_AudioFormat format, int channels, int16_t ** out){
+    *out = NULL;
+    if (!sample_format_supported(format,channels))
+        return 0;
+
+    size_t bytes_per_frame = channels*SDL_AUDIO_BITSIZE(format)/8;
+    size_t n_frames = bytes/bytes_per_frame;
+
+    *out = (int16_t *)SDL_malloc(std::max(n_frames,(size_t)1)*2*sizeof(int16_t));
+    if (*out == NULL)
+        return 0;
+
+    convert_block(src,n_frames,format,channels,*out);
+    return n_frames;
+}
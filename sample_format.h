@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <SDL2/SDL_audio.h>
+
+// Everything past the loader works on one layout: interleaved stereo int16
+// at the source sampling rate.  This converts whatever SDL_LoadWAV (or any
+// other source) handed us into that layout in a single pass.  The kernels
+// for the source format and channel count are picked once up front, so the
+// per-sample loops have no format branches.
+
+bool sample_format_supported(SDL_AudioFormat format, int channels);
+
+// Returns the number of stereo frames written to *out (0 if the format is
+// unsupported).  *out is allocated with SDL_malloc, so SDL_FreeWAV/SDL_free
+// release it like any other loaded track.
+size_t convert_to_canonical(const uint8_t * src, size_t bytes, SDL_AudioFormat format, int channels, int16_t ** out);
+
+// Streaming form of the same conversion into a caller-owned buffer of
+// n_frames*2 samples (src must hold n_frames*channels samples).
+bool convert_block(const uint8_t * src, size_t n_frames, SDL_AudioFormat format, int channels, int16_t * dst);
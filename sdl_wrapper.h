@@ -5,6 +5,8 @@
 #include <string.h>
 #include <SDL2/SDL.h>
 
+#include "palette.h"
+
 int screen_width;
 int screen_height;
 char imshow_type[256];
@@ -146,6 +148,25 @@ void imshow_update(void * array){
     
 }
 
+void imshow_update_indexed(uint8_t * array, const uint32_t * lut, uint8_t offset){
+
+    // Expand 8 bit palette indices straight into the texture, so the full
+    // size ARGB frame never exists anywhere else in memory
+    void * pixels;
+    int pitch;
+
+    if (SDL_LockTexture(tex,NULL,&pixels,&pitch) < 0){
+        imshow_log_error(std::cout,"Couldn't lock texture");
+        exit(1);
+    }
+
+    palette_expand_rows(array,screen_width,screen_height,lut,offset,(uint32_t *)pixels,pitch/4);
+
+    SDL_UnlockTexture(tex);
+    SDL_RenderCopy(renderer,tex,NULL,NULL);
+    SDL_RenderPresent(renderer);
+}
+
 void imshow_destroy(){
     SDL_DestroyTexture(tex);
     SDL_DestroyRenderer(renderer);
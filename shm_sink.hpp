@@ -0,0 +1,156 @@
+#pragma once
+
+#include <stdlib.h>
+#include <cstdio>
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "palette.h"
+
+// Publishes rendered frames into a POSIX shared memory ring (/dev/shm/<name>
+// on Linux) for other local processes.  Consumers map the object read-only
+// and use the pixels in place:
+//
+//   shm_ring_header                 at offset 0
+//   slot i header + ARGB8888 pixels at offset header_bytes + i*slot_bytes
+//
+// To read: load `latest` (acquire), go to slot (latest-1) % n_slots, load
+// its seq, use the pixels, then load seq again.  The frame is intact if
+// both loads returned the same value and it equals 2*latest.  seq is odd
+// while the producer is writing the slot.
+
+struct shm_ring_header{
+    uint32_t magic;         // 'AVIS'
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride_bytes;
+    uint32_t n_slots;
+    uint32_t header_bytes;  // Offset of slot 0
+    uint32_t slot_bytes;    // Distance between slots (header + pixels)
+    std::atomic<uint64_t> latest;  // Number of the newest complete frame, 0 before the first
+};
+
+struct shm_slot_header{
+    std::atomic<uint64_t> seq;  // 2*frame-1 while writing frame, 2*frame once complete
+    uint64_t timestamp_ns;      // steady clock at publish time
+    uint64_t frame;
+};
+
+class shm_sink{
+public:
+
+    shm_sink(const std::string &shm_name, int w, int h, int slots = 3);
+    ~shm_sink();
+
+    bool is_open(){return base != NULL;};
+
+    void publish(const uint32_t * argb);
+    void publish_indexed(const uint8_t * idx, const uint32_t * lut, uint8_t offset);
+
+private:
+
+    uint32_t * begin_frame();
+    void end_frame();
+
+    std::string name;
+    uint8_t * base = NULL;
+    size_t total_bytes = 0;
+    shm_ring_header * header = NULL;
+    shm_slot_header * slot = NULL;
+    uint64_t frame = 0;
+    int width;
+    int height;
+};
+
+shm_sink::shm_sink(const std::string &shm_name, int w, int h, int slots)
+    : name(shm_name), width(w), height(h) {
+
+    // Keep every slot (and its pixels) cache line aligned
+    size_t header_bytes = 64;
+    size_t slot_bytes   = 64 + (((size_t)4*w*h + 63) & ~(size_t)63);
+    total_bytes = header_bytes + slots*slot_bytes;
+
+    int fd = shm_open(name.c_str(),O_CREAT | O_RDWR,0644);
+    if (fd < 0){
+        std::cout << "shm_open " << name << " error: " << strerror(errno) << std::endl;
+        return;
+    }
+    if (ftruncate(fd,total_bytes) < 0){
+        std::cout << "ftruncate " << name << " error: " << strerror(errno) << std::endl;
+        close(fd);
+        return;
+    }
+    void * p = mmap(NULL,total_bytes,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if (p == MAP_FAILED){
+        std::cout << "mmap " << name << " error: " << strerror(errno) << std::endl;
+        return;
+    }
+    base = (uint8_t *)p;
+    memset(base,0,total_bytes);
+
+    header = (shm_ring_header *)base;
+    header->version      = 1;
+    header->width        = w;
+    header->height       = h;
+    header->stride_bytes = 4*w;
+    header->n_slots      = slots;
+    header->header_bytes = header_bytes;
+    header->slot_bytes   = slot_bytes;
+    header->latest.store(0,std::memory_order_relaxed);
+    // Magic last, so a consumer that sees it also sees a filled in header
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic        = 0x53495641;
+
+    std::cout << "Publishing frames to shared memory " << name << " (" << w << "x" << h << ", "
+              << slots << " slots)" << std::endl;
+}
+
+shm_sink::~shm_sink(){
+    if (base != NULL){
+        munmap(base,total_bytes);
+        shm_unlink(name.c_str());
+    }
+}
+
+uint32_t * shm_sink::begin_frame(){
+    frame++;
+    uint8_t * s = base + header->header_bytes + ((frame - 1) % header->n_slots)*header->slot_bytes;
+    slot = (shm_slot_header *)s;
+    slot->seq.store(2*frame - 1,std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return (uint32_t *)(s + 64);
+}
+
+void shm_sink::end_frame(){
+    slot->timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    slot->frame = frame;
+    slot->seq.store(2*frame,std::memory_order_release);
+    header->latest.store(frame,std::memory_order_release);
+}
+
+void shm_sink::publish(const uint32_t * argb){
+    if (base == NULL)
+        return;
+    memcpy(begin_frame(),argb,(size_t)4*width*height);
+    end_frame();
+}
+
+void shm_sink::publish_indexed(const uint8_t * idx, const uint32_t * lut, uint8_t offset){
+    // Indexed frames expand straight into the slot
+    if (base == NULL)
+        return;
+    palette_expand(idx,(size_t)width*height,lut,offset,begin_frame());
+    end_frame();
+}
@@ -1,101 +1,14 @@
 #include "visualizers.h"
+#include "palette.h"
+#include "draw.h"
+#include "polyphase.h"
+#include "worker_pool.hpp"
+#include <functional>
 #include <math.h>
+#include <string.h>
+#include <vector>
 //void render_frame_old(int16_t * song, size_t samples, uint32_t * vis_array, int w, int h){
 
-void line(int x0,int y0,int x1,int y1,uint32_t * vis_array, int h);
-
-typedef struct RgbColor
-{
-    unsigned char r;
-    unsigned char g;
-    unsigned char b;
-} RgbColor;
-
-typedef struct HsvColor
-{
-    unsigned char h;
-    unsigned char s;
-    unsigned char v;
-} HsvColor;
-
-RgbColor HsvToRgb(HsvColor hsv)
-{
-    RgbColor rgb;
-    unsigned char region, remainder, p, q, t;
-
-    if (hsv.s == 0)
-    {
-        rgb.r = hsv.v;
-        rgb.g = hsv.v;
-        rgb.b = hsv.v;
-        return rgb;
-    }
-
-    region = hsv.h / 43;
-    remainder = (hsv.h - (region * 43)) * 6; 
-
-    p = (hsv.v * (255 - hsv.s)) >> 8;
-    q = (hsv.v * (255 - ((hsv.s * remainder) >> 8))) >> 8;
-    t = (hsv.v * (255 - ((hsv.s * (255 - remainder)) >> 8))) >> 8;
-
-    switch (region)
-    {
-        case 0:
-            rgb.r = hsv.v; rgb.g = t; rgb.b = p;
-            break;
-        case 1:
-            rgb.r = q; rgb.g = hsv.v; rgb.b = p;
-            break;
-        case 2:
-            rgb.r = p; rgb.g = hsv.v; rgb.b = t;
-            break;
-        case 3:
-            rgb.r = p; rgb.g = q; rgb.b = hsv.v;
-            break;
-        case 4:
-            rgb.r = t; rgb.g = p; rgb.b = hsv.v;
-            break;
-        default:
-            rgb.r = hsv.v; rgb.g = p; rgb.b = q;
-            break;
-    }
-
-    return rgb;
-}
-
-HsvColor RgbToHsv(RgbColor rgb)
-{
-    HsvColor hsv;
-    unsigned char rgbMin, rgbMax;
-
-    rgbMin = rgb.r < rgb.g ? (rgb.r < rgb.b ? rgb.r : rgb.b) : (rgb.g < rgb.b ? rgb.g : rgb.b);
-    rgbMax = rgb.r > rgb.g ? (rgb.r > rgb.b ? rgb.r : rgb.b) : (rgb.g > rgb.b ? rgb.g : rgb.b);
-
-    hsv.v = rgbMax;
-    if (hsv.v == 0)
-    {
-        hsv.h = 0;
-        hsv.s = 0;
-        return hsv;
-    }
-
-    hsv.s = 255 * long(rgbMax - rgbMin) / hsv.v;
-    if (hsv.s == 0)
-    {
-        hsv.h = 0;
-        return hsv;
-    }
-
-    if (rgbMax == rgb.r)
-        hsv.h = 0 + 43 * (rgb.g - rgb.b) / (rgbMax - rgbMin);
-    else if (rgbMax == rgb.g)
-        hsv.h = 85 + 43 * (rgb.b - rgb.r) / (rgbMax - rgbMin);
-    else
-        hsv.h = 171 + 43 * (rgb.r - rgb.g) / (rgbMax - rgbMin);
-
-    return hsv;
-}
-
 void *  memset32(void * s, uint32_t c, size_t n_elements){
     // Almost the exact same implementation as memset, but takes n_elements (number of 32 bit words to write)
     // rather than number of bytes to write.
@@ -107,163 +20,100 @@ void *  memset32(void * s, uint32_t c, size_t n_elements){
     return s;
 }
 
-void rect(int x, int y, int w, int h, int w_w, int w_h, uint32_t * vis_array,uint32_t C){
+void fill_rows(uint32_t * vis_array, int w, int h, int stride, uint32_t c){
+    // Background fill that only touches our own w x h region, so it's safe
+    // when vis_array is a viewport into a bigger framebuffer
+    for (int j=0;j<h;j++)
+        memset32(vis_array + j*stride,c,w);
+}
+
+void rect(int x, int y, int w, int h, int w_w, int w_h, int stride, uint32_t * vis_array,uint32_t C){
     // Draw left/right rectangle showing max channel values
     for (int i=x;i<(x+w);i++){
         for (int j=y;j<(y+h);j++){
-            int idx = i + w_h*(w_h - j);
+            int idx = i + stride*(w_h - j);
             vis_array[idx] = C;            
         }
     }    
 }
 
-void simple(struct vis_data * v){
-
-    int16_t * song = v->song;
-    size_t samples = v->samples;
-    uint32_t * vis_array = v->vis_array;
-    int w = v->w;
-    int h = v->h;
-    
-    memset(vis_array,0,w*h*sizeof(uint32_t));
-
-    // Step through each column and set one pixel on
-    for (int i=0;i<w;i++){
-        
-        int sample_idx = (size_t)(i*((float)samples/(float)w));
-        sample_idx = ((sample_idx%2 == 0) ? sample_idx : sample_idx - 1);
-
-        // Extract the sound signal data
-        float span = 140000;
-        float di  = span/h;
-        float i_cent = (h-1.0f)/2.0f;
-
-        // Left channel (blue)
-        int vertical_idx = song[sample_idx]/di+i_cent;        
-        vis_array[i + vertical_idx*h] = 0xFFFF0000;
-        
-        // Right Channel (red)
-        vertical_idx = song[sample_idx+1]/di + i_cent;
-        vis_array[i + vertical_idx*h] = 0xFF0000FF;
-    }    
-}
-
-void simple_bw(struct vis_data *v){
+enum channel_map{
+    MAP_TRACE,  // Time along x, both channels plotted against it
+    MAP_XY      // Left channel is x, right channel is y
+};
+
+// One pixel per point, for the simple trace and oscilloscope styles.
+// Colors, channel mapping and Span (the signal range across the full
+// height, and width for MAP_XY) are fixed per instantiation.  W and H, when
+// nonzero, fix the frame size too so the scale factors fold into constants;
+// frames of any other size go to the generic build.  Stride stays a runtime
+// value so viewports work either way.
+template<channel_map Map, uint32_t Background, uint32_t Left, uint32_t Right, int Span, int W = 0, int H = 0>
+void plot(struct vis_data * v){
+
+    if ((W != 0 && v->w != W) || (H != 0 && v->h != H)){
+        plot<Map,Background,Left,Right,Span>(v);
+        return;
+    }
 
     int16_t * song = v->song;
     size_t samples = v->samples;
     uint32_t * vis_array = v->vis_array;
-    int w = v->w;
-    int h = v->h;
-    
-    //memset(vis_array,0xFF,w*h*sizeof(uint32_t));
-    memset32(vis_array,0xFFFFFFFF,w*h);    
-
-    // Step through each column and set one pixel on
-    for (int i=0;i<w;i++){
-        
-        int sample_idx = (size_t)(i*((float)samples/(float)w));
-        sample_idx = ((sample_idx%2 == 0) ? sample_idx : sample_idx - 1);
-
-        // Extract the sound signal data
-        float span = 140000;
-        float di  = span/h;
-        float i_cent = (h-1.0f)/2.0f;
-
-        // Left channel (blue)
-        int vertical_idx = song[sample_idx]/di+i_cent;        
-        vis_array[i + vertical_idx*h] = 0xFF000000;
-        
-        // Right Channel (red)
-        vertical_idx = song[sample_idx+1]/di + i_cent;
-        vis_array[i + vertical_idx*h] = 0xFF000000;
+    const int w = W ? W : v->w;
+    const int h = H ? H : v->h;
+    int stride = v->stride;
+
+    fill_rows(vis_array,w,h,stride,Background);
+
+    // Pixels per unit of signal and the centre row, both Q24, so each point
+    // costs a multiply and a shift instead of a float divide
+    const int64_t ky = ((int64_t)h << 24)/Span;
+    const int64_t cy = (int64_t)(h - 1) << 23;
+
+    if (Map == MAP_TRACE){
+        // Step through each column and set one pixel on per channel
+        const uint64_t step = ((uint64_t)samples << 24)/w;
+        for (int i=0;i<w;i++){
+            size_t sample_idx = (size_t)((i*step) >> 24) & ~(size_t)1;
+            int yl = (song[sample_idx]*ky + cy) >> 24;
+            int yr = (song[sample_idx+1]*ky + cy) >> 24;
+            vis_array[i + yl*stride] = Left;
+            vis_array[i + yr*stride] = Right;
+        }
+    }
+    else{
+        // Left channel is X axis, Right channel is Y.  Both use the shorter
+        // side's scale so the figure isn't stretched on wide frames.
+        const int64_t k  = ((int64_t)std::min(w,h) << 24)/Span;
+        const int64_t cx = (int64_t)(w - 1) << 23;
+        for (size_t i=0;i<samples;i+=2){
+            int x = (song[i]*k + cx) >> 24;
+            int y = (song[i+1]*k + cy) >> 24;
+            vis_array[x + y*stride] = Left;
+        }
     }
 }
 
+// Left channel blue, right channel red
+#define SIMPLE_ARGS       MAP_TRACE,0x00000000,0xFFFF0000,0xFF0000FF,140000
+#define SIMPLE_BW_ARGS    MAP_TRACE,0xFFFFFFFF,0xFF000000,0xFF000000,140000
+#define HACKER_ARGS       MAP_TRACE,0xFF000000,0xFF00FF00,0xFF00FF00,140000
+#define OSCILLOSCOPE_ARGS MAP_XY,0xFF000000,0xFF00FF00,0xFF00FF00,110000
 
-void hacker(struct vis_data *v){
-
-    int16_t * song = v->song;
-    size_t samples = v->samples;
-    uint32_t * vis_array = v->vis_array;
-    int w = v->w;
-    int h = v->h;
-    
-    //memset(vis_array,0xFF,w*h*sizeof(uint32_t));
-    memset32(vis_array,0xFF000000,w*h);    
-
-    // Step through each column and set one pixel on
-    for (int i=0;i<w;i++){
-        
-        int sample_idx = (size_t)(i*((float)samples/(float)w));
-        sample_idx = ((sample_idx%2 == 0) ? sample_idx : sample_idx - 1);
-
-        // Extract the sound signal data
-        float span = 140000;
-        float di  = span/h;
-        float i_cent = (h-1.0f)/2.0f;
-
-        // Left channel (blue)
-        int vertical_idx = song[sample_idx]/di+i_cent;        
-        vis_array[i + vertical_idx*h] = 0xFF00FF00;
-        
-        // Right Channel (red)
-        vertical_idx = song[sample_idx+1]/di + i_cent;
-        vis_array[i + vertical_idx*h] = 0xFF00FF00;
-    }
+void simple(struct vis_data * v){
+    plot<SIMPLE_ARGS>(v);
 }
 
-void oscilloscope(struct vis_data *v){
+void simple_bw(struct vis_data * v){
+    plot<SIMPLE_BW_ARGS>(v);
+}
 
-    int16_t * song = v->song;
-    size_t samples = v->samples;
-    uint32_t * vis_array = v->vis_array;
-    int w = v->w;
-    int h = v->h;
-    
-    //memset(vis_array,0xFF,w*h*sizeof(uint32_t));
-    memset32(vis_array,0xFF000000,w*h);    
-
-    // Step through each column and set one pixel on
-    for (int i=0;i<samples;i+=2){
-        
-        // Extract the sound signal data
-        float span = 110000;
-        float di  = span/h;
-        float i_cent = (h-1.0f)/2.0f;
-
-        // Right channel is X axis, Left channel is Y
-        int x = song[i]/di + i_cent;
-        int y = song[i+1]/di + i_cent;        
-
-        vis_array[x + y*h] = 0xFF00FF00;
-    }
+void hacker(struct vis_data * v){
+    plot<HACKER_ARGS>(v);
 }
 
-void line(int x0,int y0,int x1,int y1,uint32_t * vis_array, int h){
-    float delta_x = x1 - x0;
-    float delta_y = y1 - y0;
-    float delta_err = fabs(delta_y/delta_x);
-    float err = 0.0f;
-    int sign_y = (delta_y>0.0f) ? 1 : -1;
-
-    // Bresenham
-    if (delta_x!=0){
-        int y = y0;        
-        for (int x = x0; x < x1; x++){
-            vis_array[x + y*h] = 0xFF00FF00;
-            err = err + delta_err;
-            if (err>=0.5f){
-                y = y + sign_y;
-                err = err - 1.0f;
-            }
-        }
-    }
-    // Vertical line
-    else{
-        for (int y=y0; y!=y1; y+=sign_y)
-            vis_array[x0 + y*h] = 0xFF00FF00;                        
-    }
+void oscilloscope(struct vis_data * v){
+    plot<OSCILLOSCOPE_ARGS>(v);
 }
 
 void oscilloscope_fancy(struct vis_data *v){
@@ -275,91 +125,178 @@ void oscilloscope_fancy(struct vis_data *v){
     uint32_t * vis_array = v->vis_array;
     int w = v->w;
     int h = v->h;
+    int stride = v->stride;
 
     // Extract the sound signal data
+    // Same scale on both axes (the shorter side) so wide frames don't
+    // stretch the figure
     float span = 110000;
-    float di  = span/h;
+    float di  = span/std::min(w,h);
     float i_cent = (h-1.0f)/2.0f;
+    float di_x = di;
+    float x_cent = (w-1.0f)/2.0f;
     
     //memset32(vis_array,0xFF000000,w*h);
 
-    // Instead of zeroing, multiply green channel by some factor
-    for (int i=0;i<h;i++){
-        for (int j=0;j<w;j++){
-            // Extract the green channel
-            uint8_t g = (vis_array[j + i*h] & 0x0000FF00) >> 8;
-            g *= 0.7f ;
-            uint32_t new_val = g;
-            new_val = (new_val << 8) + 0xFF000000;
-            vis_array[j + i*h] = new_val;
-
-            /////// Extract the color channels
-            /////uint32_t curr_color = vis_array[j + i*h];
-            /////uint8_t r = (curr_color & 0x00FF0000) >> 24;
-            /////uint8_t g = (curr_color & 0x0000FF00) >> 16;
-            /////uint8_t b = (curr_color & 0x000000FF) >> 8;
-            /////
-            /////RgbColor rgb;
-            /////rgb.r = r;
-            /////rgb.g = g;
-            /////rgb.b = b;
-            /////
-            /////HsvColor hsv = RgbToHsv(rgb);
-            /////
-            /////a *= 0.75f;
-            /////uint32_t new_val = a;
-            /////new_val = (new_val << 24) + vis_array[j+i*h];
-            /////vis_array[j + i*h] = new_val;            
-        }
-    }
-
-    int x,y;
-    int x_prev,y_prev;
-    for (int i=0;i<samples;i+=2){
-        
-        x = song[i]/di + i_cent;
-        y = song[i+1]/di + i_cent;        
-        //vis_array[x + y*h] = 0xFF00FF00;
-        vis_array[x + (h-y)*h] = color;        
-        
-        // Right channel is X axis, Left channel is Y
-        //x = song[i]/di + i_cent;
-        //y = song[i+1]/di + i_cent;
-        //
-        //if (i!=0)
-        //    line(x_prev,y_prev,x,y,vis_array,h);
-        //
-        //x_prev = x;
-        //y_prev = y;
+    // Instead of zeroing, multiply green channel by some factor (179/256,
+    // about 0.7)
+    for (int i=0;i<h;i++)
+        draw_fade(vis_array + i*stride,w,0x0000FF00,179);
+
+    // Left channel is X axis, Right channel is Y.  Consecutive samples are
+    // joined into one connected, anti-aliased trace.  The point buffer is
+    // kept between frames (per thread, tiles may run this concurrently).
+    static thread_local std::vector<point> pts;
+    pts.resize(samples/2);
+    for (size_t i=0;i<samples/2;i++){
+        pts[i].x = song[2*i]/di_x + x_cent;
+        pts[i].y = (h-1) - (song[2*i+1]/di + i_cent);
     }
+    draw_polyline(&pts[0],pts.size(),vis_array,w,h,stride,color);
 }
 
-int16_t max_l, max_r = 0;
-
 void experimental(struct vis_data * v){
     int16_t * song = v->song;
     size_t samples = v->samples;
     uint32_t * vis_array = v->vis_array;
     int w = v->w;
     int h = v->h;
+    int stride = v->stride;
 
-    memset32(vis_array,0xFF000000,w*h);
+    fill_rows(vis_array,w,h,stride,0xFF000000);
 
-    int tmp_max_l, tmp_max_r = 0;
+    int tmp_max_l = 0, tmp_max_r = 0;
     
     // Find the maximum of each channel
     for (int i=0;i<samples;i++){
         tmp_max_l = std::max(song[2*i]  ,(int16_t)(tmp_max_l));
         tmp_max_r = std::max(song[2*i+1],(int16_t)(tmp_max_r));        
     }
-    max_l = std::max(tmp_max_l,(int)(.95*max_l));
-    max_r = std::max(tmp_max_r,(int)(.95*max_r));
+
+    // Peaks decay in signal level, not pixels, so every view keeps its own
+    // and the frame size doesn't matter
+    float * peaks = v->peaks;
+    peaks[0] = std::max(tmp_max_l/32000.0f,0.95f*peaks[0]);
+    peaks[1] = std::max(tmp_max_r/32000.0f,0.95f*peaks[1]);
 
     // Scale into pixels
-    max_l = std::max((int)(((float)max_l/(float)32000) * 3*h/4),1);
-    max_r = std::max((int)(((float)max_r/(float)32000) * 3*h/4),1);
+    int max_l = std::max((int)(peaks[0]*3*h/4),1);
+    int max_r = std::max((int)(peaks[1]*3*h/4),1);
 
     // Draw left/right rectangle showing max channel values
-    rect(w*(1.0/4.0 - 1.0/8.0)  , h*(1.0/8.0) , w*(1.0/4.0) , max_l  ,w ,h ,vis_array , 0xFF00FF00);
-    rect(w*(3.0/4.0 - 1.0/8.0 ) , h*(1.0/8.0) , w*(1.0/4.0) , max_r ,w ,h ,vis_array , 0xFF00FF00);
+    rect(w*(1.0/4.0 - 1.0/8.0)  , h*(1.0/8.0) , w*(1.0/4.0) , max_l  ,w ,h ,stride ,vis_array , 0xFF00FF00);
+    rect(w*(3.0/4.0 - 1.0/8.0 ) , h*(1.0/8.0) , w*(1.0/4.0) , max_r ,w ,h ,stride ,vis_array , 0xFF00FF00);
+}
+
+void vectorscope(struct vis_data * v){
+
+    int16_t * song = v->song;
+    size_t samples = v->samples;
+    uint8_t * index_array = v->index_array;
+    int w = v->w;
+    int h = v->h;
+
+    // Built once, shared by every call
+    static const int upsample = 4;
+    static polyphase_interpolator interp(upsample);
+    static uint32_t lut[256];
+    static uint8_t tone_map[1024];
+    static const bool initialized = [](){
+        HsvColor dark   = {170,255,0};
+        HsvColor bright = {20,120,255};
+        palette_gradient(lut,dark,bright);
+
+        // Log scale so a handful of hits is visible but dense regions don't
+        // all saturate to the same color
+        for (int i=0;i<1024;i++)
+            tone_map[i] = (i == 0) ? 0 : std::min(255,(int)(40.0f + 215.0f*logf((float)i)/logf(1023.0f)));
+        return true;
+    }();
+    (void)initialized;
+
+    float span = 110000;
+    float scale_x = std::min(w,h)/span;  // Square figure on any frame shape
+    float scale_y = scale_x;
+    float x_cent = (w-1.0f)/2.0f;
+    float y_cent = (h-1.0f)/2.0f;
+
+    // Upsampling is the expensive part and splits cleanly: each task fills
+    // its own slice of l/r.  Binning a frame's few thousand points is cheap
+    // enough to stay serial, so there's one histogram and no per-thread
+    // tiles to zero and reduce.  Without a pool everything runs inline.
+    worker_pool * pool = v->pool;
+    auto for_each = [pool](size_t n, std::function<void(size_t)> fn){
+        if (pool != NULL)
+            pool->parallel_for(n,fn);
+        else{
+            for (size_t i=0;i<n;i++)
+                fn(i);
+        }
+    };
+    size_t workers = pool ? pool->size() : 1;
+
+    size_t n_points = samples*upsample;
+    std::vector<float> l(n_points), r(n_points);
+    size_t n_slices = std::max((size_t)1,std::min(workers,samples/256));
+    for_each(n_slices,[&](size_t t){
+        size_t begin = samples*t/n_slices;
+        size_t end   = samples*(t+1)/n_slices;
+        interp.process(song,samples,2,begin,end,&l[begin*upsample]);
+        interp.process(song+1,samples,2,begin,end,&r[begin*upsample]);
+    });
+
+    size_t n_px = (size_t)w*h;
+    std::vector<uint16_t> hist(n_px,0);
+    for (size_t i=0;i<n_points;i++){
+        int x = (int)(l[i]*scale_x + x_cent);
+        int y = (int)(r[i]*scale_y + y_cent);
+        x = std::min(std::max(x,0),w-1);
+        y = std::min(std::max(y,0),h-1);
+        uint16_t & bin = hist[x + (h-1-y)*w];
+        bin += (bin != 0xFFFF);
+    }
+
+    // Tone map to palette indices, one band of rows per task
+    size_t n_bands = std::min((size_t)h,4*workers);
+    for_each(n_bands,[&](size_t b){
+        size_t begin = n_px*b/n_bands;
+        size_t end   = n_px*(b+1)/n_bands;
+        for (size_t i=begin;i<end;i++)
+            index_array[i] = tone_map[std::min((uint32_t)hist[i],(uint32_t)1023)];
+    });
+
+    v->indexed        = true;
+    v->palette        = lut;
+    v->palette_offset = 0;
+}
+
+struct specialization{
+    callback generic;
+    int w;
+    int h;
+    callback fixed;
+};
+
+// Frame sizes something actually renders at: the player window, and the
+// exporter's default, 1080p and 4K outputs.  Only the visualizers whose
+// background isn't a single repeated byte gain from it; with the width a
+// constant their fill vectorizes, while simple and simple_bw already clear
+// with memset and measure the same either way.
+#define SPECIALIZE(vis,args) \
+    {vis,512,512,plot<args,512,512>}, \
+    {vis,1280,720,plot<args,1280,720>}, \
+    {vis,1920,1080,plot<args,1920,1080>}, \
+    {vis,3840,2160,plot<args,3840,2160>}
+
+static const specialization specializations[] = {
+    SPECIALIZE(hacker,HACKER_ARGS),
+    SPECIALIZE(oscilloscope,OSCILLOSCOPE_ARGS)
+};
+
+callback specialize(callback vis, int w, int h){
+    for (const specialization & s : specializations){
+        if (s.generic == vis && s.w == w && s.h == h)
+            return s.fixed;
+    }
+    return vis;
 }
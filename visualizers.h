@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <cstdio>
 #include <iostream>
+#include <stdint.h>
+
+class worker_pool;
 
 struct vis_data{
     int16_t * song;
@@ -10,11 +13,32 @@ struct vis_data{
     uint32_t * vis_array;
     int w;
     int h;
+    int stride;  // Pixels between rows of vis_array (w unless drawing into a viewport)
+    worker_pool * pool;  // Caller's threads for visualizers that split a frame; NULL runs serially
+    float * peaks;       // Two decaying channel levels (0..1) the caller keeps across frames, one pair per view
+
+    // Indexed mode: instead of vis_array, a visualizer may fill index_array
+    // (w*h bytes, tightly packed) and set indexed; the palette is expanded to ARGB
+    // when the frame is uploaded.  Callers reset indexed before each frame.
+    uint8_t * index_array;
+    const uint32_t * palette;
+    uint8_t palette_offset;
+    bool indexed;
 };
 
+typedef void (*callback)(struct vis_data * v);
+
+// Fills only the w x h region of a strided buffer (safe on viewports)
+void fill_rows(uint32_t * vis_array, int w, int h, int stride, uint32_t c);
+
 void simple(struct vis_data * v);
 void simple_bw(struct vis_data * v);
 void hacker(struct vis_data * v);
 void experimental(struct vis_data * v);
 void oscilloscope(struct vis_data * v);
 void oscilloscope_fancy(struct vis_data * v);
+void vectorscope(struct vis_data * v);
+
+// Build of vis compiled for a fixed w x h frame if there is one, otherwise
+// vis itself.  Either way the result still handles any frame size.
+callback specialize(callback vis, int w, int h);
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+// Small fixed-size thread pool.  Tasks are run in FIFO order by whichever
+// worker is free.  parallel_for blocks until its own indices are finished
+// (not until the whole queue drains) so background work submitted by someone
+// else on the same pool doesn't stall the caller.
+
+class worker_pool{
+public:
+
+    worker_pool(size_t n_threads = 0);
+    ~worker_pool();
+
+    void submit(std::function<void()> task);
+    void parallel_for(size_t n, std::function<void(size_t)> fn);
+    size_t size(){return workers.size();};
+
+private:
+
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    bool stopping = false;
+};
+
+inline worker_pool::worker_pool(size_t n_threads){
+    if (n_threads == 0)
+        n_threads = std::max(1u,std::thread::hardware_concurrency());
+
+    for (size_t i=0;i<n_threads;i++)
+        workers.push_back(std::thread(&worker_pool::worker_loop,this));
+}
+
+inline worker_pool::~worker_pool(){
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+        tasks.clear();
+    }
+    queue_cv.notify_all();
+    for (size_t i=0;i<workers.size();i++)
+        workers[i].join();
+}
+
+inline void worker_pool::submit(std::function<void()> task){
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        tasks.push_back(task);
+    }
+    queue_cv.notify_one();
+}
+
+inline void worker_pool::worker_loop(){
+    while (true){
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock,[this]{return stopping || !tasks.empty();});
+            if (stopping)
+                return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+inline void worker_pool::parallel_for(size_t n, std::function<void(size_t)> fn){
+    if (n == 0)
+        return;
+
+    // Shared between the caller and any helper tasks.  Helpers that only get
+    // scheduled after everything is finished find no indices left and exit,
+    // so the state has to outlive this call.
+    struct pf_state{
+        std::function<void(size_t)> fn;
+        size_t n;
+        std::atomic<size_t> next;
+        std::atomic<size_t> done;
+        std::mutex m;
+        std::condition_variable cv;
+    };
+    std::shared_ptr<pf_state> st = std::make_shared<pf_state>();
+    st->fn   = fn;
+    st->n    = n;
+    st->next = 0;
+    st->done = 0;
+
+    auto run = [st](){
+        size_t i;
+        while ((i = st->next.fetch_add(1)) < st->n){
+            st->fn(i);
+            if (st->done.fetch_add(1) + 1 == st->n){
+                std::lock_guard<std::mutex> lock(st->m);
+                st->cv.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min(n,workers.size()) - 1;
+    for (size_t i=0;i<helpers;i++)
+        submit(run);
+
+    // The caller works too, which also keeps nested calls from deadlocking
+    run();
+
+    std::unique_lock<std::mutex> lock(st->m);
+    st->cv.wait(lock,[&st]{return st->done.load() == st->n;});
+}